@@ -0,0 +1,30 @@
+#!/bin/sh
+# Benchmark fling against benchwm on a private Xvfb, for each population of
+# clients in $BENCH_CLIENTS. See flingbench.cc for the scenarios.
+#
+#   BENCH_CLIENTS     client windows to populate the display with (default "10 100 1000")
+#   BENCH_ITERATIONS  runs of each scenario (default 50)
+#   BENCH_LATENCY     msec benchwm waits before acting on a request (default 0)
+#   BENCH_MONITORS    RandR monitors to split the screen into (default 2)
+#   BENCH_DISPLAY     display for Xvfb (default :77)
+
+set -e
+display=${BENCH_DISPLAY:-:77}
+ready=$(mktemp)
+trap 'kill $wm $xvfb 2>/dev/null; rm -f "$ready"' EXIT
+
+for clients in ${BENCH_CLIENTS:-10 100 1000}; do
+    Xvfb "$display" -screen 0 1920x1080x24 -nolisten tcp >/dev/null 2>&1 &
+    xvfb=$!
+    : > "$ready"
+    DISPLAY=$display ./benchwm -c "$clients" -l "${BENCH_LATENCY:-0}" \
+        -m "${BENCH_MONITORS:-2}" > "$ready" &
+    wm=$!
+    until grep -q ready "$ready"; do
+        kill -0 $wm 2>/dev/null || { echo "benchwm failed to start" >&2; exit 1; }
+        sleep 0.1
+    done
+    DISPLAY=$display ./flingbench -n "${BENCH_ITERATIONS:-50}" -l "$clients"
+    kill $wm $xvfb
+    wait $wm $xvfb 2>/dev/null || true
+done
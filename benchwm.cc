@@ -0,0 +1,348 @@
+/*
+ * A stand-in window manager for benchmarking fling: just enough EWMH to
+ * answer everything fling asks, with a population of client windows and
+ * docks of its own, and an optional delay before acting on requests, to
+ * play the part of a slow WM.
+ *
+ * It doesn't reparent: frames are notional, but advertised through
+ * _NET_FRAME_EXTENTS all the same, so fling does all the work it would
+ * with a real WM.
+ */
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/Xrandr.h>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <poll.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+static Display *display;
+static Window root;
+static int latency; // milliseconds before we act on a client's request.
+
+static const long frameExtents[] = { 2, 2, 20, 2 }; // left, right, top, bottom
+
+enum {
+    NET_SUPPORTED, NET_SUPPORTING_WM_CHECK, NET_WM_NAME, UTF8_STRING,
+    NET_CLIENT_LIST, NET_ACTIVE_WINDOW, NET_CURRENT_DESKTOP, NET_NUMBER_OF_DESKTOPS,
+    NET_WORKAREA, NET_FRAME_EXTENTS, NET_REQUEST_FRAME_EXTENTS, NET_MOVERESIZE_WINDOW,
+    NET_WM_STATE, NET_WM_DESKTOP, NET_WM_PID, NET_WM_STRUT, NET_WM_STRUT_PARTIAL,
+    NET_WM_WINDOW_TYPE, NET_WM_WINDOW_TYPE_DOCK,
+    ATOM_COUNT
+};
+static const char *atomNames[] = {
+    "_NET_SUPPORTED", "_NET_SUPPORTING_WM_CHECK", "_NET_WM_NAME", "UTF8_STRING",
+    "_NET_CLIENT_LIST", "_NET_ACTIVE_WINDOW", "_NET_CURRENT_DESKTOP", "_NET_NUMBER_OF_DESKTOPS",
+    "_NET_WORKAREA", "_NET_FRAME_EXTENTS", "_NET_REQUEST_FRAME_EXTENTS", "_NET_MOVERESIZE_WINDOW",
+    "_NET_WM_STATE", "_NET_WM_DESKTOP", "_NET_WM_PID", "_NET_WM_STRUT", "_NET_WM_STRUT_PARTIAL",
+    "_NET_WM_WINDOW_TYPE", "_NET_WM_WINDOW_TYPE_DOCK",
+};
+static Atom atoms[ATOM_COUNT];
+
+static std::vector<Window> clients;
+
+// Requests waiting out our artificial latency.
+struct Pending {
+    long due; // msec
+    std::function<void()> action;
+};
+static std::deque<Pending> pending;
+
+static long
+msecNow()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+later(std::function<void()> action)
+{
+    if (latency == 0)
+        action();
+    else
+        pending.push_back(Pending { msecNow() + latency, action });
+}
+
+static void
+setCardinals(Window win, Atom prop, const long *values, int count)
+{
+    XChangeProperty(display, win, prop, XA_CARDINAL, 32, PropModeReplace,
+            (const unsigned char *)values, count);
+}
+
+static void
+publishClients()
+{
+    XChangeProperty(display, root, atoms[NET_CLIENT_LIST], XA_WINDOW, 32, PropModeReplace,
+            (const unsigned char *)clients.data(), clients.size());
+}
+
+static void
+manage(Window win)
+{
+    long desktop = 0;
+    setCardinals(win, atoms[NET_FRAME_EXTENTS], frameExtents, 4);
+    setCardinals(win, atoms[NET_WM_DESKTOP], &desktop, 1);
+    XMapWindow(display, win);
+    if (std::find(clients.begin(), clients.end(), win) == clients.end()) {
+        clients.push_back(win);
+        publishClients();
+    }
+}
+
+static void
+activate(Window win)
+{
+    XChangeProperty(display, root, atoms[NET_ACTIVE_WINDOW], XA_WINDOW, 32, PropModeReplace,
+            (const unsigned char *)&win, 1);
+}
+
+static void
+changeState(Window win, long action, Atom first, Atom second)
+{
+    std::vector<Atom> state;
+    Atom type;
+    int format;
+    unsigned long count, after;
+    unsigned char *prop;
+    if (XGetWindowProperty(display, win, atoms[NET_WM_STATE], 0, 64, False, XA_ATOM,
+            &type, &format, &count, &after, &prop) == Success && prop) {
+        state.assign((Atom *)prop, (Atom *)prop + count);
+        XFree(prop);
+    }
+    for (Atom atom : { first, second }) {
+        if (atom == None)
+            continue;
+        auto it = std::find(state.begin(), state.end(), atom);
+        bool present = it != state.end();
+        bool want = action == 1 || (action == 2 && !present);
+        if (present && !want)
+            state.erase(it);
+        else if (!present && want)
+            state.push_back(atom);
+    }
+    XChangeProperty(display, win, atoms[NET_WM_STATE], XA_ATOM, 32, PropModeReplace,
+            (const unsigned char *)state.data(), state.size());
+}
+
+static void
+clientMessage(const XClientMessageEvent &ev)
+{
+    Window win = ev.window;
+    if (ev.message_type == atoms[NET_MOVERESIZE_WINDOW]) {
+        long flags = ev.data.l[0];
+        XWindowChanges changes;
+        unsigned mask = 0;
+        changes.x = ev.data.l[1];
+        changes.y = ev.data.l[2];
+        changes.width = ev.data.l[3];
+        changes.height = ev.data.l[4];
+        if (flags & 0x100) mask |= CWX;
+        if (flags & 0x200) mask |= CWY;
+        if (flags & 0x400) mask |= CWWidth;
+        if (flags & 0x800) mask |= CWHeight;
+        later([=]() mutable { XConfigureWindow(display, win, mask, &changes); });
+    } else if (ev.message_type == atoms[NET_WM_STATE]) {
+        long action = ev.data.l[0];
+        Atom first = ev.data.l[1], second = ev.data.l[2];
+        later([=]() { changeState(win, action, first, second); });
+    } else if (ev.message_type == atoms[NET_ACTIVE_WINDOW]) {
+        later([=]() { activate(win); });
+    } else if (ev.message_type == atoms[NET_REQUEST_FRAME_EXTENTS]) {
+        setCardinals(win, atoms[NET_FRAME_EXTENTS], frameExtents, 4);
+    }
+}
+
+/*
+ * Populate the display: every dockEvery'th window is a dock reserving a
+ * strip along one edge of the screen, the rest ordinary windows scattered
+ * about. The last ordinary window is made active.
+ */
+static void
+populate(int count, int dockEvery)
+{
+    int width = DisplayWidth(display, DefaultScreen(display));
+    int height = DisplayHeight(display, DefaultScreen(display));
+    long workarea[] = { 0, 0, width, height };
+    Window active = None;
+    for (int i = 0; i < count; ++i) {
+        bool dock = dockEvery != 0 && i % dockEvery == 0;
+        int x = (i * 37) % (width - 200), y = (i * 53) % (height - 150);
+        Window win = XCreateSimpleWindow(display, root, x, y, 200, 150, 0, 0, 0xffffff);
+        long pid = getpid();
+        setCardinals(win, atoms[NET_WM_PID], &pid, 1);
+        if (dock) {
+            // Struts take turns around the edges, and grow a little as they go.
+            long thickness = 10 + i % 7;
+            long strut[12] = { 0 };
+            int edge = (i / dockEvery) % 4;
+            strut[edge] = thickness;
+            strut[4 + edge * 2] = 0; // start of the range along the edge
+            strut[5 + edge * 2] = (edge < 2 ? height : width) - 1;
+            setCardinals(win, atoms[NET_WM_STRUT_PARTIAL], strut, 12);
+            setCardinals(win, atoms[NET_WM_STRUT], strut, 4);
+            XChangeProperty(display, win, atoms[NET_WM_WINDOW_TYPE], XA_ATOM, 32,
+                    PropModeReplace, (const unsigned char *)&atoms[NET_WM_WINDOW_TYPE_DOCK], 1);
+            switch (edge) {
+                case 0: workarea[0] = std::max(workarea[0], thickness); break;
+                case 1: workarea[2] = std::min(workarea[2], width - thickness); break;
+                case 2: workarea[1] = std::max(workarea[1], thickness); break;
+                case 3: workarea[3] = std::min(workarea[3], height - thickness); break;
+            }
+        } else {
+            active = win;
+        }
+        manage(win);
+    }
+    workarea[2] -= workarea[0];
+    workarea[3] -= workarea[1];
+    setCardinals(root, atoms[NET_WORKAREA], workarea, 4);
+    if (active != None)
+        activate(active);
+}
+
+/*
+ * Split the screen into side-by-side RandR monitors, so fling has to work
+ * out the usable areas from struts rather than just reading _NET_WORKAREA.
+ */
+static void
+splitMonitors(int count)
+{
+    int width = DisplayWidth(display, DefaultScreen(display));
+    int height = DisplayHeight(display, DefaultScreen(display));
+    for (int i = 0; i < count; ++i) {
+        XRRMonitorInfo *monitor = XRRAllocateMonitor(display, 0);
+        std::string name = "BENCH-" + std::to_string(i);
+        monitor->name = XInternAtom(display, name.c_str(), False);
+        monitor->primary = i == 0;
+        monitor->x = width * i / count;
+        monitor->y = 0;
+        monitor->width = width * (i + 1) / count - monitor->x;
+        monitor->height = height;
+        monitor->mwidth = monitor->width / 4;
+        monitor->mheight = monitor->height / 4;
+        XRRSetMonitor(display, root, monitor);
+        XRRFreeMonitors(monitor);
+    }
+}
+
+static void
+usage()
+{
+    std::clog << "usage: benchwm [ -c clients ] [ -d dock-every ] [ -l latency-msec ] [ -m monitors ]" << std::endl;
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int clientCount = 0, dockEvery = 10, monitorCount = 1, c;
+    while ((c = getopt(argc, argv, "c:d:l:m:")) != -1) {
+        switch (c) {
+            case 'c':
+                clientCount = atoi(optarg);
+                break;
+            case 'd':
+                dockEvery = atoi(optarg);
+                break;
+            case 'l':
+                latency = atoi(optarg);
+                break;
+            case 'm':
+                monitorCount = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+
+    // The X server may still be starting up.
+    for (int tries = 0; (display = XOpenDisplay(0)) == 0; ++tries) {
+        if (tries == 50) {
+            std::clog << "failed to open display" << std::endl;
+            return 1;
+        }
+        usleep(100000);
+    }
+    root = DefaultRootWindow(display);
+    XInternAtoms(display, (char **)atomNames, ATOM_COUNT, False, atoms);
+    XSelectInput(display, root, SubstructureRedirectMask | SubstructureNotifyMask);
+
+    Window check = XCreateSimpleWindow(display, root, 0, 0, 1, 1, 0, 0, 0);
+    for (Window w : { root, check })
+        XChangeProperty(display, w, atoms[NET_SUPPORTING_WM_CHECK], XA_WINDOW, 32,
+                PropModeReplace, (const unsigned char *)&check, 1);
+    XChangeProperty(display, check, atoms[NET_WM_NAME], atoms[UTF8_STRING], 8,
+            PropModeReplace, (const unsigned char *)"benchwm", 7);
+    XChangeProperty(display, root, atoms[NET_SUPPORTED], XA_ATOM, 32, PropModeReplace,
+            (const unsigned char *)atoms, ATOM_COUNT);
+    long desktops = 1, current = 0;
+    setCardinals(root, atoms[NET_NUMBER_OF_DESKTOPS], &desktops, 1);
+    setCardinals(root, atoms[NET_CURRENT_DESKTOP], &current, 1);
+
+    if (monitorCount > 1)
+        splitMonitors(monitorCount);
+    populate(clientCount, dockEvery);
+    XSync(display, False);
+    std::cout << "ready" << std::endl;
+
+    pollfd pfd;
+    pfd.fd = ConnectionNumber(display);
+    pfd.events = POLLIN;
+    for (;;) {
+        while (XPending(display)) {
+            XEvent ev;
+            XNextEvent(display, &ev);
+            switch (ev.type) {
+                case MapRequest:
+                    manage(ev.xmaprequest.window);
+                    XSetInputFocus(display, ev.xmaprequest.window, RevertToPointerRoot, CurrentTime);
+                    break;
+                case ConfigureRequest: {
+                    const XConfigureRequestEvent &req = ev.xconfigurerequest;
+                    XWindowChanges changes;
+                    changes.x = req.x;
+                    changes.y = req.y;
+                    changes.width = req.width;
+                    changes.height = req.height;
+                    changes.border_width = req.border_width;
+                    changes.sibling = req.above;
+                    changes.stack_mode = req.detail;
+                    XConfigureWindow(display, req.window, req.value_mask, &changes);
+                    break;
+                }
+                case DestroyNotify:
+                case UnmapNotify: {
+                    Window win = ev.type == DestroyNotify ? ev.xdestroywindow.window : ev.xunmap.window;
+                    auto it = std::find(clients.begin(), clients.end(), win);
+                    if (it != clients.end()) {
+                        clients.erase(it);
+                        publishClients();
+                    }
+                    break;
+                }
+                case ClientMessage:
+                    clientMessage(ev.xclient);
+                    break;
+            }
+        }
+        long now = msecNow();
+        while (!pending.empty() && pending.front().due <= now) {
+            pending.front().action();
+            pending.pop_front();
+        }
+        XFlush(display);
+        int timeout = pending.empty() ? -1 : std::max(0L, pending.front().due - now);
+        poll(&pfd, 1, timeout);
+    }
+}
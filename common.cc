@@ -1,5 +1,19 @@
-#include "wmhack.h"
+#include "shared.h"
+#include <algorithm>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <X11/Xatom.h>
 #include <X11/extensions/Xrandr.h>
+#include <X11/extensions/sync.h>
 
 std::ostream &
 operator<<(std::ostream &os, const Geometry &m)
@@ -11,12 +25,698 @@ operator<<(std::ostream &os, const Geometry &m)
                 << " }";
 }
 
-X11Env::X11Env(Display *display_)
+static const struct {
+    const char *name;
+    Atom X11Env::*atom;
+} atomNames[] = {
+    { "_NET_CURRENT_DESKTOP",         &X11Env::NetCurrentDesktop },
+    { "_NET_ACTIVE_WINDOW",           &X11Env::NetActiveWindow },
+    { "_NET_DESKTOP_NAMES",           &X11Env::NetDesktopNames },
+    { "WINDOW",                       &X11Env::AWindow },
+    { "CARDINAL",                     &X11Env::Cardinal },
+    { "VISUALID",                     &X11Env::VisualId },
+    { "_NET_MOVERESIZE_WINDOW",       &X11Env::NetMoveResizeWindow },
+    { "_NET_FRAME_EXTENTS",           &X11Env::NetFrameExtents },
+    { "_NET_CLIENT_LIST",             &X11Env::NetClientList },
+    { "_NET_WM_STRUT",                &X11Env::NetWmStrut },
+    { "_NET_WM_STRUT_PARTIAL",        &X11Env::NetWmStrutPartial },
+    { "_NET_WM_STATE_FULLSCREEN",     &X11Env::NetWmStateFullscreen },
+    { "_NET_WM_STATE_BELOW",          &X11Env::NetWmStateBelow },
+    { "_NET_WM_STATE_ABOVE",          &X11Env::NetWmStateAbove },
+    { "_NET_WM_STATE",                &X11Env::NetWmState },
+    { "_NET_WM_DESKTOP",              &X11Env::NetWmDesktop },
+    { "_NET_WM_STATE_ADD",            &X11Env::NetWmStateAdd },
+    { "_NET_WM_STATE_MAXIMIZED_VERT", &X11Env::NetWmStateMaximizedVert },
+    { "_NET_WM_STATE_MAXIMIZED_HORZ", &X11Env::NetWmStateMaximizedHoriz },
+    { "_NET_WM_STATE_SHADED",         &X11Env::NetWmStateShaded },
+    { "_NET_WM_WINDOW_OPACITY",       &X11Env::NetWmOpacity },
+    { "_NET_WM_PID",                  &X11Env::NetWmPid },
+    { "_NET_WORKAREA",                &X11Env::NetWorkarea },
+    { "_NET_WM_SYNC_REQUEST",         &X11Env::NetWmSyncRequest },
+    { "_NET_WM_SYNC_REQUEST_COUNTER", &X11Env::NetWmSyncRequestCounter },
+    { "WM_PROTOCOLS",                 &X11Env::WmProtocols },
+    { "_PME_WORKDIR",                 &X11Env::WorkDir },
+    { "_NET_WM_NAME",                 &X11Env::NetWmName },
+    { "UTF8_STRING",                  &X11Env::Utf8String },
+    { "_NET_SUPPORTED",               &X11Env::NetSupported },
+};
+
+Geometry
+intersect(const Geometry &a, const Geometry &b)
+{
+    Geometry rv;
+    rv.x = std::max(a.x, b.x);
+    rv.y = std::max(a.y, b.y);
+    long right = std::min(a.x + long(a.size.width), b.x + long(b.size.width));
+    long bottom = std::min(a.y + long(a.size.height), b.y + long(b.size.height));
+    rv.size.width = std::max(right - rv.x, 0L);
+    rv.size.height = std::max(bottom - rv.y, 0L);
+    return rv;
+}
+
+// So a publisher and its readers can tell they agree on atomNames. FNV-1a.
+static uint64_t
+atomNamesHash()
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (auto &atom : atomNames)
+        for (const char *p = atom.name; ; ++p) {
+            h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+            if (*p == 0)
+                break;
+        }
+    return h;
+}
+
+X11Env::X11Env(Display *display_, bool useShared)
     : display(display_)
     , root(XDefaultRootWindow(display))
-    , rootGeom(getGeometry(root))
 {
-    detectMonitors();
+    // The root window's size comes with the connection setup: no need to ask.
+    int screen = DefaultScreen(display);
+    rootGeom.size.width = DisplayWidth(display, screen);
+    rootGeom.size.height = DisplayHeight(display, screen);
+    rootGeom.x = rootGeom.y = 0;
+
+    constexpr size_t count = sizeof atomNames / sizeof atomNames[0];
+    char *names[count];
+    Atom atoms[count];
+    for (size_t i = 0; i < count; ++i)
+        names[i] = (char *)atomNames[i].name;
+
+    resetStats(getenv("FLING_STATS"), getenv("FLING_TRACE"));
+    Span span(*this, "X11Env");
+    // A publisher has interned the atoms for us.
+    if (useShared && readShared())
+        return;
+    RoundTrip wait(*this);
+    if (!XInternAtoms(display, names, count, False, atoms))
+        throw "can't intern atoms";
+    for (size_t i = 0; i < count; ++i)
+        this->*atomNames[i].atom = atoms[i];
+}
+
+std::string
+sharedName(const char *display)
+{
+    std::string name = std::string("/fling-") + std::to_string(getuid()) + "-" + XDisplayName(display);
+    for (size_t i = 1; i < name.size(); ++i)
+        if (name[i] == '/')
+            name[i] = '_';
+    return name;
+}
+
+bool
+X11Env::readShared()
+{
+    int fd = shm_open(sharedName(DisplayString(display)).c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) == sizeof (SharedState))
+        map = mmap(0, sizeof (SharedState), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    // Copy it out, and try again if the publisher was writing as we did.
+    auto live = (const SharedState *)map;
+    sharedCopy.resize(sizeof (SharedState));
+    auto copy = (SharedState *)&sharedCopy[0];
+    bool consistent = false;
+    for (int tries = 0; !consistent && tries < 100; ++tries) {
+        uint32_t sequence = __atomic_load_n(&live->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, live, offsetof(SharedState, clients));
+        memcpy(copy->clients, live->clients,
+              std::min(size_t(copy->clientCount), SHARED_CLIENTS) * sizeof (SharedClient));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        consistent = __atomic_load_n(&live->sequence, __ATOMIC_RELAXED) == sequence;
+    }
+    munmap(map, sizeof (SharedState));
+
+    // It has to be for this server, as it is now, from a publisher that's still watching it.
+    constexpr size_t count = sizeof atomNames / sizeof atomNames[0];
+    static_assert(count <= SHARED_ATOMS, "too many atoms to share");
+    if (!consistent || copy->magic != SHARED_MAGIC || copy->version != SHARED_VERSION
+            || copy->root != root || copy->atomNames != atomNamesHash() || copy->dirty
+            || copy->clientCount > SHARED_CLIENTS || copy->monitorCount > SHARED_MONITORS
+            || copy->workareaCount > SHARED_DESKTOPS * 4
+            || (kill(copy->publisher, 0) == -1 && errno != EPERM)) {
+        sharedCopy.clear();
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i)
+        this->*atomNames[i].atom = copy->atoms[i];
+    for (size_t i = 0; i < copy->clientCount; ++i)
+        sharedClients[copy->clients[i].win] = &copy->clients[i];
+    shared = copy;
+    return true;
+}
+
+void
+X11Env::shareAtoms(SharedState &state) const
+{
+    state.atomNames = atomNamesHash();
+    for (size_t i = 0; i < sizeof atomNames / sizeof atomNames[0]; ++i)
+        state.atoms[i] = this->*atomNames[i].atom;
+}
+
+const SharedClient *
+X11Env::sharedClient(Window win) const
+{
+    if (prefetching && !prefetchStale && win != 0 && prefetched.win == win)
+        return &prefetched;
+    auto it = sharedClients.find(win);
+    return it == sharedClients.end() ? 0 : it->second;
+}
+
+bool
+X11Env::mayHaveState(Window win, Atom atom) const
+{
+    const SharedClient *client = sharedClient(win);
+    if (client == 0)
+        return true;
+    uint32_t bit = atom == NetWmStateShaded ? SHARED_SHADED
+        : atom == NetWmStateMaximizedHoriz ? SHARED_MAXIMIZED_HORZ
+        : atom == NetWmStateFullscreen ? SHARED_FULLSCREEN : 0;
+    return bit == 0 || (client->state & bit) != 0;
+}
+
+uint32_t
+X11Env::stateFlags(const std::vector<long> &atoms) const
+{
+    uint32_t flags = 0;
+    for (auto atom : atoms) {
+        if (Atom(atom) == NetWmStateShaded)
+            flags |= SHARED_SHADED;
+        else if (Atom(atom) == NetWmStateMaximizedHoriz)
+            flags |= SHARED_MAXIMIZED_HORZ;
+        else if (Atom(atom) == NetWmStateFullscreen)
+            flags |= SHARED_FULLSCREEN;
+    }
+    return flags;
+}
+
+void
+X11Env::watchActive()
+{
+    prefetching = true;
+    prefetchStale = true;
+    selectInput(root, PropertyChangeMask);
+    prefetch();
+}
+
+bool
+X11Env::prefetch()
+{
+    if (!prefetching || !prefetchStale)
+        return false;
+    Span span(*this, "prefetch");
+    SharedClient client;
+    memset(&client, 0, sizeof client);
+    client.desktop = -1;
+    client.win = activeWindow();
+    if (client.win != 0) {
+        // Hear about anything that changes from before we read it.
+        selectInput(client.win, PropertyChangeMask | StructureNotifyMask);
+        enum { FRAME, DESKTOP, PID, STATE, REQUESTS };
+        PropertyBatch props(*this, "prefetch batch");
+        GeometryBatch geoms(*this);
+        props.request(client.win, NetFrameExtents, Cardinal);
+        props.request(client.win, NetWmDesktop, Cardinal);
+        props.request(client.win, NetWmPid, Cardinal);
+        props.request(client.win, NetWmState, XA_ATOM);
+        geoms.request(client.win);
+        if (geoms.geometry(0, &client.geom)) {
+            props.cardinals(FRAME, client.frame, 4);
+            props.cardinals(DESKTOP, &client.desktop, 1);
+            props.cardinals(PID, &client.pid, 1);
+            std::vector<long> atoms;
+            props.cardinals(STATE, atoms);
+            client.state = stateFlags(atoms);
+        } else {
+            client.win = 0; // gone already.
+        }
+    }
+    prefetched = client;
+    prefetchStale = false;
+    return true;
+}
+
+static Bool
+affectsPrefetch(Display *, XEvent *event, XPointer arg)
+{
+    auto x11 = (const X11Env *)arg;
+    switch (event->type) {
+        case PropertyNotify:
+            return event->xproperty.window == x11->root
+                || event->xproperty.window == x11->prefetched.win;
+        case ConfigureNotify:
+        case UnmapNotify:
+        case DestroyNotify:
+            return event->xany.window == x11->prefetched.win;
+        default:
+            return False;
+    }
+}
+
+void
+X11Env::catchUp()
+{
+    // Only reads what has already arrived: no round trip.
+    XEvent event;
+    while (XCheckIfEvent(display, &event, affectsPrefetch, (XPointer)this))
+        handleEvent(event);
+}
+
+long
+nsecNow()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Bytes this process has read and written, from /proc/self/io, less what
+ * we've read of that file itself.
+ */
+static void
+ioCounters(long long *read, long long *written)
+{
+    static long long overhead;
+    *read = *written = 0;
+    FILE *f = fopen("/proc/self/io", "r");
+    if (f == 0)
+        return;
+    char line[128];
+    long long rchar = 0, wchar = 0, len = 0;
+    while (fgets(line, sizeof line, f)) {
+        len += strlen(line);
+        sscanf(line, "rchar: %lld", &rchar);
+        sscanf(line, "wchar: %lld", &wchar);
+    }
+    fclose(f);
+    *read = rchar - overhead;
+    *written = wchar;
+    overhead += len;
+}
+
+RoundTrip::RoundTrip(const X11Env &x11_, unsigned long count)
+    : x11(x11_)
+{
+    x11.roundTrips += count;
+    if (x11.inPhase)
+        x11.phases.back().roundTrips += count;
+    if (x11.waitDepth++ == 0)
+        x11.waitStarted = nsecNow();
+}
+
+RoundTrip::~RoundTrip()
+{
+    if (--x11.waitDepth == 0 && x11.inPhase)
+        x11.phases.back().waitNs += nsecNow() - x11.waitStarted;
+}
+
+void
+X11Env::phase(const char *name)
+{
+    endPhase();
+    Phase p;
+    p.name = name;
+    p.firstRequest = XNextRequest(display);
+    p.started = nsecNow();
+    p.readStart = p.writeStart = -1;
+    if (instrument)
+        ioCounters(&p.readStart, &p.writeStart);
+    phases.push_back(p);
+    inPhase = true;
+}
+
+void
+X11Env::endPhase()
+{
+    if (!inPhase)
+        return;
+    inPhase = false;
+    Phase &p = phases.back();
+    p.requests = XNextRequest(display) - p.firstRequest;
+    p.elapsedNs = nsecNow() - p.started;
+    trace(p.name, p.started, p.started + p.elapsedNs,
+            "{\"requests\":" + std::to_string(p.requests)
+            + ",\"roundTrips\":" + std::to_string(p.roundTrips) + "}");
+    if (instrument && p.readStart != -1) {
+        long long read, written;
+        ioCounters(&read, &written);
+        p.bytesIn = read - p.readStart;
+        p.bytesOut = written - p.writeStart;
+    }
+}
+
+Span::Span(const X11Env &x11_, const char *name_)
+    : x11(x11_)
+    , name(name_)
+    , start(!x11.tracePath.empty() ? nsecNow() : 0)
+{
+}
+
+Span::~Span()
+{
+    if (!x11.tracePath.empty())
+        x11.trace(name, start, nsecNow());
+}
+
+void
+X11Env::trace(const std::string &name, long start, long end, const std::string &args) const
+{
+    if (!tracePath.empty())
+        traceEvents.push_back(TraceEvent { name, 'X', start, end - start, args });
+}
+
+void
+X11Env::traceInstant(const std::string &name, long when, const std::string &args) const
+{
+    if (!tracePath.empty())
+        traceEvents.push_back(TraceEvent { name, 'i', when, 0, args });
+}
+
+void
+X11Env::writeTrace() const
+{
+    if (tracePath.empty() || traceEvents.empty())
+        return;
+    std::ofstream out(tracePath);
+    if (!out) {
+        std::clog << "can't write trace to " << tracePath << std::endl;
+        return;
+    }
+    // Phases are spans too: they nest the rest, so put the longest first.
+    auto events = traceEvents;
+    std::stable_sort(events.begin(), events.end(), [](const TraceEvent &l, const TraceEvent &r) {
+        return l.start < r.start || (l.start == r.start && l.duration > r.duration);
+    });
+    char times[80];
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (size_t i = 0; i < events.size(); ++i) {
+        const TraceEvent &e = events[i];
+        snprintf(times, sizeof times, "\"ts\":%.3f,\"dur\":%.3f", e.start / 1e3, e.duration / 1e3);
+        out << (i ? ",\n" : "\n")
+            << "{\"name\":\"" << e.name << "\",\"ph\":\"" << e.type << "\","
+            << times << ",\"pid\":" << getpid() << ",\"tid\":1"
+            << (e.type == 'i' ? ",\"s\":\"t\"" : "")
+            << (e.args.empty() ? "" : ",\"args\":" + e.args) << "}";
+    }
+    out << "\n]}\n";
+    traceEvents.clear();
+}
+
+void
+X11Env::resetStats(const char *stats_, const char *tracePath_)
+{
+    roundTrips = 0;
+    phases.clear();
+    inPhase = false;
+    instrument = stats_ != 0;
+    stats = stats_ ? stats_ : "";
+    tracePath = tracePath_ ? tracePath_ : "";
+    traceEvents.clear();
+    phase("setup");
+}
+
+void
+X11Env::reportPhases(std::ostream &os, bool json) const
+{
+    Phase total;
+    total.name = "total";
+    total.bytesIn = total.bytesOut = 0;
+    for (auto &p : phases) {
+        total.requests += p.requests;
+        total.roundTrips += p.roundTrips;
+        total.waitNs += p.waitNs;
+        total.elapsedNs += p.elapsedNs;
+        if (p.bytesIn == -1 || total.bytesIn == -1)
+            total.bytesIn = total.bytesOut = -1;
+        else {
+            total.bytesIn += p.bytesIn;
+            total.bytesOut += p.bytesOut;
+        }
+    }
+    std::vector<const Phase *> rows;
+    for (auto &p : phases)
+        rows.push_back(&p);
+    rows.push_back(&total);
+
+    char line[160];
+    if (json) {
+        os << "{\"phases\":[";
+        for (auto p : rows) {
+            snprintf(line, sizeof line, "{\"name\":\"%s\",\"requests\":%lu,\"roundTrips\":%lu,"
+                    "\"waitMs\":%.3f,\"elapsedMs\":%.3f,\"bytesOut\":%lld,\"bytesIn\":%lld}",
+                    p->name, p->requests, p->roundTrips, p->waitNs / 1e6, p->elapsedNs / 1e6,
+                    p->bytesOut, p->bytesIn);
+            os << (p == rows[0] ? "" : ",") << line;
+        }
+        os << "]}" << std::endl;
+        return;
+    }
+    snprintf(line, sizeof line, "%-10s %9s %12s %9s %11s %10s %10s",
+            "phase", "requests", "round trips", "wait ms", "elapsed ms", "bytes out", "bytes in");
+    os << line << "\n";
+    for (auto p : rows) {
+        auto bytes = [](long long n) { return n == -1 ? std::string("-") : std::to_string(n); };
+        snprintf(line, sizeof line, "%-10s %9lu %12lu %9.3f %11.3f %10s %10s",
+                p->name, p->requests, p->roundTrips, p->waitNs / 1e6, p->elapsedNs / 1e6,
+                bytes(p->bytesOut).c_str(), bytes(p->bytesIn).c_str());
+        os << line << "\n";
+    }
+    os << "round trips: " << roundTrips << std::endl;
+}
+
+PropertyBatch::PropertyBatch(const X11Env &x11_, const char *name)
+    : x11(x11_)
+    , span(x11_, name)
+    , conn(XGetXCBConnection(x11.display))
+    , waited(false)
+{
+}
+
+PropertyBatch::~PropertyBatch()
+{
+    for (size_t i = 0; i < cookies.size(); ++i)
+        if (!collected[i])
+            xcb_discard_reply(conn, cookies[i].sequence);
+}
+
+size_t
+PropertyBatch::request(Window win, Atom property, Atom type, uint32_t length)
+{
+    cookies.push_back(xcb_get_property(conn, 0, win, property, type, 0, length));
+    collected.push_back(false);
+    return cookies.size() - 1;
+}
+
+xcb_get_property_reply_t *
+PropertyBatch::reply(size_t ticket)
+{
+    // Only the first reply makes us wait: the rest are already on their way.
+    RoundTrip wait(x11, waited ? 0 : 1);
+    waited = true;
+    collected[ticket] = true;
+    xcb_generic_error_t *error = 0;
+    auto rv = xcb_get_property_reply(conn, cookies[ticket], &error);
+    free(error); // the window may have gone away since we listed it.
+    return rv;
+}
+
+bool
+PropertyBatch::cardinals(size_t ticket, long *values, size_t count)
+{
+    auto r = reply(ticket);
+    if (r == 0)
+        return false;
+    bool ok = r->format == 32 && r->value_len == count;
+    if (ok) {
+        auto data = (const int32_t *)xcb_get_property_value(r);
+        for (size_t i = 0; i < count; ++i)
+            values[i] = data[i];
+    }
+    free(r);
+    return ok;
+}
+
+bool
+PropertyBatch::cardinals(size_t ticket, std::vector<long> &values)
+{
+    auto r = reply(ticket);
+    if (r == 0)
+        return false;
+    bool ok = r->format == 32;
+    if (ok) {
+        auto data = (const int32_t *)xcb_get_property_value(r);
+        values.assign(data, data + r->value_len);
+    }
+    free(r);
+    return ok;
+}
+
+bool
+PropertyBatch::text(size_t ticket, std::string &value)
+{
+    auto r = reply(ticket);
+    if (r == 0)
+        return false;
+    bool ok = r->format == 8;
+    if (ok)
+        value.assign((const char *)xcb_get_property_value(r), xcb_get_property_value_length(r));
+    free(r);
+    return ok;
+}
+
+GeometryBatch::GeometryBatch(const X11Env &x11_, const char *name)
+    : x11(x11_)
+    , span(x11_, name)
+    , conn(XGetXCBConnection(x11.display))
+    , waited(false)
+{
+}
+
+GeometryBatch::~GeometryBatch()
+{
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        if (!collected[i]) {
+            xcb_discard_reply(conn, sizes[i].sequence);
+            xcb_discard_reply(conn, origins[i].sequence);
+        }
+    }
+}
+
+size_t
+GeometryBatch::request(Window win)
+{
+    sizes.push_back(xcb_get_geometry(conn, win));
+    origins.push_back(xcb_translate_coordinates(conn, win, x11.root, 0, 0));
+    collected.push_back(false);
+    return sizes.size() - 1;
+}
+
+bool
+GeometryBatch::geometry(size_t ticket, Geometry *geom)
+{
+    RoundTrip wait(x11, waited ? 0 : 1);
+    waited = true;
+    collected[ticket] = true;
+    xcb_generic_error_t *error = 0;
+    auto size = xcb_get_geometry_reply(conn, sizes[ticket], &error);
+    free(error);
+    error = 0;
+    auto origin = xcb_translate_coordinates_reply(conn, origins[ticket], &error);
+    free(error);
+    bool ok = size != 0 && origin != 0;
+    if (ok) {
+        geom->size.width = size->width;
+        geom->size.height = size->height;
+        geom->x = origin->dst_x;
+        geom->y = origin->dst_y;
+    }
+    free(size);
+    free(origin);
+    return ok;
+}
+
+Transaction::Transaction(const X11Env &x11_)
+    : x11(x11_)
+{
+}
+
+Transaction::Change &
+Transaction::add(Change::Kind kind, Window win)
+{
+    changes.push_back(Change());
+    Change &change = changes.back();
+    change.kind = kind;
+    change.win = win;
+    return change;
+}
+
+void
+Transaction::state(Window win, Atom atom, X11Env::StateUpdateAction action, Atom second)
+{
+    Change &change = add(Change::STATE, win);
+    change.atom = atom;
+    change.second = second;
+    change.value = action;
+}
+
+void
+Transaction::desktop(Window win, long desktop)
+{
+    add(Change::DESKTOP, win).value = desktop;
+}
+
+void
+Transaction::geometry(Window win, const Geometry &geom)
+{
+    add(Change::GEOMETRY, win).geom = geom;
+}
+
+void
+Transaction::property(Window win, Atom property, Atom type, int format, const void *data, int count)
+{
+    Change &change = add(Change::PROPERTY, win);
+    change.atom = property;
+    change.type = type;
+    change.format = format;
+    // Xlib takes format-32 data as longs.
+    size_t size = count * (format == 32 ? sizeof (long) : format / 8);
+    change.data.assign((const unsigned char *)data, (const unsigned char *)data + size);
+    change.value = count;
+}
+
+void
+Transaction::commit(bool wait)
+{
+    Span span(x11, "commit");
+    for (auto &change : changes) {
+        switch (change.kind) {
+            case Change::STATE:
+                x11.sendState(change.win, change.atom, X11Env::StateUpdateAction(change.value),
+                      change.second);
+                break;
+            case Change::DESKTOP:
+                x11.sendDesktop(change.win, change.value);
+                break;
+            case Change::GEOMETRY:
+                x11.sendGeometry(change.win, change.geom);
+                break;
+            case Change::PROPERTY:
+                XChangeProperty(x11, change.win, change.atom, change.type, change.format,
+                      PropModeReplace, change.data.data(), change.value);
+                break;
+        }
+    }
+    changes.clear();
+    if (wait) {
+        RoundTrip waiting(x11);
+        XSync(x11, False);
+    } else {
+        XFlush(x11);
+    }
+}
+
+int
+X11Env::getProperty(Window win, Atom property, Atom type, int *actualFormat,
+      unsigned long *itemCount, unsigned char **prop, long length) const
+{
+    Atom actualType;
+    unsigned long afterBytes;
+    RoundTrip wait(*this);
+    return XGetWindowProperty(display, win, property, 0, length, False, type,
+            &actualType, actualFormat, itemCount, &afterBytes, prop);
 }
 
 Geometry 
@@ -25,6 +725,7 @@ X11Env::getGeometry(Window w) const
     Window root;
     Geometry geom = getGeometry(w, &root);
     // Locate origin of this window in root.
+    RoundTrip wait(*this);
     Status s = XTranslateCoordinates(display, w, root, 0, 0, &geom.x, &geom.y, &root);
     if (!s) {
        throw "can't translate geometry";
@@ -38,6 +739,7 @@ X11Env::getGeometry(Window w, Window *root) const
     Geometry returnValue;
     unsigned int borderWidth;
     unsigned int depth;
+    RoundTrip wait(*this);
     Status s = XGetGeometry(display, w, root,  &returnValue.x, &returnValue.y,
                 &returnValue.size.width, &returnValue.size.height, &borderWidth, &depth);
     if (!s)
@@ -48,14 +750,25 @@ X11Env::getGeometry(Window w, Window *root) const
 int
 X11Env::monitorForWindow(Window win)
 {
+    const SharedClient *client = sharedClient(win);
+    if (client != 0)
+        return monitorAt(client->geom);
+
     Window winroot;
     Status s;
     Geometry geom = getGeometry(win, &winroot);
+    RoundTrip wait(*this);
     s = XTranslateCoordinates(display, win, winroot,  0, 0, &geom.x, &geom.y, &winroot);
     if (!s) {
         std::cerr << "Can't translate root window coordinates" << std::endl;
         return 0;
     }
+    return monitorAt(geom);
+}
+
+int
+DisplayBackend::monitorAt(const Geometry &geom)
+{
     int midX = geom.x + geom.size.width / 2;
     int midY = geom.y + geom.size.height / 2;
 
@@ -63,6 +776,7 @@ X11Env::monitorForWindow(Window win)
      * XXX: really need to sort by area of window on the monitor:
      * centre may not be in any // monitor
      */
+    getMonitors();
     for (size_t i = 0; i < monitors.size(); ++i) {
         Geometry &mon = monitors[i];
         if (midX >= mon.x && midX < mon.x + int(mon.size.width)
@@ -74,7 +788,7 @@ X11Env::monitorForWindow(Window win)
 }
 
 void
-X11Env::setGeometry(Window win, const Geometry &geom) const
+X11Env::sendGeometry(Window win, const Geometry &geom) const
 {
     // Tell the WM where to put it.
     XEvent e;
@@ -91,16 +805,397 @@ X11Env::setGeometry(Window win, const Geometry &geom) const
     ec.data.l[3] = geom.size.width;
     ec.data.l[4] = geom.size.height;
     XSendEvent(display, root, False, SubstructureRedirectMask|SubstructureNotifyMask, &e);
-    XSync(display, False);
+}
+
+bool
+X11Env::syncExtension()
+{
+    if (!syncChecked) {
+        syncChecked = true;
+        int errorBase, major, minor;
+        RoundTrip wait(*this, 2);
+        if (!XSyncQueryExtension(display, &syncEventBase, &errorBase)
+                || !XSyncInitialize(display, &major, &minor))
+            syncEventBase = 0;
+    }
+    return syncEventBase != 0;
+}
+
+double
+X11Env::refreshRate(int monitor)
+{
+    if (shared != 0 && size_t(monitor) < shared->monitorCount && shared->refreshRates[monitor] > 0)
+        return shared->refreshRates[monitor];
+    if (refreshRates.empty()) {
+        getMonitors();
+        refreshRates.assign(monitors.size(), 0.0);
+        int eventBase, eventError;
+        RoundTrip wait(*this);
+        if (XRRQueryExtension(display, &eventBase, &eventError) != 0) {
+            RoundTrip wait(*this);
+            XRRScreenResources *res = XRRGetScreenResourcesCurrent(display, root);
+            for (int i = 0; res && i < res->ncrtc; ++i) {
+                RoundTrip wait(*this);
+                XRRCrtcInfo *crtc = XRRGetCrtcInfo(display, res, res->crtcs[i]);
+                if (crtc == 0)
+                    continue;
+                for (int m = 0; crtc->mode != None && m < res->nmode; ++m) {
+                    const XRRModeInfo &mode = res->modes[m];
+                    if (mode.id != crtc->mode || mode.hTotal == 0 || mode.vTotal == 0)
+                        continue;
+                    double rate = double(mode.dotClock) / (mode.hTotal * mode.vTotal);
+                    Geometry where;
+                    where.x = crtc->x;
+                    where.y = crtc->y;
+                    where.size.width = crtc->width;
+                    where.size.height = crtc->height;
+                    // Where CRTCs are cloned, go with the fastest.
+                    double &current = refreshRates[monitorAt(where)];
+                    current = std::max(current, rate);
+                }
+                XRRFreeCrtcInfo(crtc);
+            }
+            if (res)
+                XRRFreeScreenResources(res);
+        }
+    }
+    double rate = refreshRates[monitor];
+    return rate > 0 ? rate : 60;
+}
+
+const std::vector<Geometry> &
+DisplayBackend::getMonitors()
+{
+    if (monitors.empty())
+        detectMonitors();
+    return monitors;
+}
+
+/*
+ * Xinerama only matters on servers without RandR 1.5, so we only load it
+ * when we find ourselves on one, rather than linking against it.
+ */
+struct Xinerama {
+    decltype(&XineramaQueryExtension) queryExtension;
+    decltype(&XineramaQueryScreens) queryScreens;
+    Xinerama() : queryExtension(0), queryScreens(0) {
+        void *lib = dlopen("libXinerama.so.1", RTLD_LAZY);
+        if (lib == 0)
+            return;
+        queryExtension = (decltype(queryExtension))dlsym(lib, "XineramaQueryExtension");
+        queryScreens = (decltype(queryScreens))dlsym(lib, "XineramaQueryScreens");
+        if (queryScreens == 0)
+            queryExtension = 0;
+    }
+};
+
+void
+X11Env::selectInput(Window win, long mask)
+{
+    long &current = eventMasks[win];
+    if ((current & mask) == mask)
+        return;
+    current |= mask;
+    XSelectInput(display, win, current);
+}
+
+const Geometry &
+DisplayBackend::usableArea(long desktop, int monitor)
+{
+    auto &areas = usableAreas[desktop];
+    if (areas.empty())
+        areas = findUsableAreas(desktop);
+    // Monitors come from the command line and layouts, so may not exist.
+    if (monitor < 0 || size_t(monitor) >= areas.size())
+        throw "no such monitor";
+    return areas[monitor];
+}
+
+/*
+ * Work out each monitor's usable area on a desktop, from what the WM tells
+ * us, or from the struts of all the clients.
+ */
+std::vector<Geometry>
+DisplayBackend::findUsableAreas(long desktop)
+{
+    std::vector<Geometry> areas = getMonitors();
+    DesktopInfo info;
+    readDesktops(info);
+
+    /*
+     * The WM has done the work for us in _NET_WORKAREA, but it's a single
+     * rectangle for the whole screen, so it can only describe what panels
+     * leave free when there's one monitor.
+     */
+    size_t index = desktop >= 0 ? desktop : info.currentDesktop;
+    if (areas.size() == 1 && info.workarea.size() >= (index + 1) * 4) {
+        Geometry wa;
+        wa.x = info.workarea[index * 4];
+        wa.y = info.workarea[index * 4 + 1];
+        wa.size.width = info.workarea[index * 4 + 2];
+        wa.size.height = info.workarea[index * 4 + 3];
+        areas[0] = intersect(areas[0], wa);
+        return areas;
+    }
+
+    if (info.clients.empty()) {
+        std::cerr << "can't list clients to do strut processing" << std::endl;
+        return areas;
+    }
+
+    // Otherwise, work it out from the struts of every client.
+    std::vector<ClientStruts> struts;
+    readStruts(info.clients, struts);
+    for (size_t i = struts.size(); i-- > 0;) {
+        ClientStruts &client = struts[i];
+        if (client.desktop != desktop && client.desktop != -1 && desktop != -1)
+            continue;
+        for (auto &area : areas)
+            client.strut.box(rootGeom, area);
+    }
+    return areas;
+}
+
+void
+X11Env::readDesktops(DesktopInfo &info)
+{
+    if (shared != 0) {
+        info.workarea.assign(shared->workarea, shared->workarea + shared->workareaCount);
+        info.currentDesktop = shared->currentDesktop;
+        for (size_t i = 0; i < shared->clientCount; ++i)
+            info.clients.push_back(shared->clients[i].win);
+        return;
+    }
+
+    // Hear about new panels or changes to the work area.
+    selectInput(root, PropertyChangeMask);
+
+    PropertyBatch rootProps(*this, "workarea batch");
+    auto workareaTicket = rootProps.request(root, NetWorkarea, Cardinal);
+    auto currentTicket = rootProps.request(root, NetCurrentDesktop, Cardinal);
+    auto clientsTicket = rootProps.request(root, NetClientList, AWindow, 1 << 20);
+    std::vector<long> clients;
+    rootProps.cardinals(workareaTicket, info.workarea);
+    rootProps.cardinals(currentTicket, &info.currentDesktop, 1);
+    rootProps.cardinals(clientsTicket, clients);
+    info.clients.assign(clients.begin(), clients.end());
+}
+
+/*
+ * Ask for every client's desktop and struts up front, rather than waiting on
+ * each in turn: this costs one round trip however many clients there are.
+ */
+void
+X11Env::readStruts(const std::vector<Window> &clients, std::vector<ClientStruts> &struts)
+{
+    if (shared != 0) {
+        for (auto win : clients) {
+            const SharedClient *client = sharedClient(win);
+            if (client != 0 && client->hasStrut)
+                struts.push_back(ClientStruts { client->desktop, client->strut });
+        }
+        return;
+    }
+
+    enum { DESKTOP, PARTIAL, LEGACY, REQUESTS };
+    PropertyBatch batch(*this, "strut batch");
+    for (auto win : clients) {
+        batch.request(win, NetWmDesktop, Cardinal);
+        batch.request(win, NetWmStrutPartial, Cardinal);
+        batch.request(win, NetWmStrut, Cardinal);
+    }
+
+    for (size_t i = 0; i < clients.size(); ++i) {
+        ClientStruts client;
+        client.desktop = -1;
+        batch.cardinals(i * REQUESTS + DESKTOP, &client.desktop, 1);
+        long values[12];
+        PartialStrut *strut = (PartialStrut *)values;
+        if (!batch.cardinals(i * REQUESTS + PARTIAL, values, 12)) {
+            if (!batch.cardinals(i * REQUESTS + LEGACY, values, 4))
+                continue;
+            // A legacy strut reserves its edge along the entire screen.
+            strut->rleft.start = strut->rright.start = 0;
+            strut->rleft.end = strut->rright.end = rootGeom.size.height - 1;
+            strut->rtop.start = strut->rbottom.start = 0;
+            strut->rtop.end = strut->rbottom.end = rootGeom.size.width - 1;
+        }
+        client.strut = *strut;
+        struts.push_back(client);
+        // Find out if the panel moves or changes its size.
+        selectInput(clients[i], PropertyChangeMask);
+    }
+}
+
+void
+X11Env::describeWindows(const std::vector<Window> &windows, std::vector<WindowInfo> &infos)
+{
+    if (prefetching)
+        catchUp();
+    if ((shared != 0 || prefetching) && std::all_of(windows.begin(), windows.end(),
+            [this](Window win) { return sharedClient(win) != 0; })) {
+        infos.resize(windows.size());
+        for (size_t i = 0; i < windows.size(); ++i) {
+            const SharedClient *client = sharedClient(windows[i]);
+            infos[i].exists = true;
+            infos[i].geom = client->geom;
+            memcpy(infos[i].frame, client->frame, sizeof infos[i].frame);
+            infos[i].desktop = client->desktop;
+        }
+        return;
+    }
+
+    enum { FRAME, DESKTOP, REQUESTS };
+    PropertyBatch props(*this);
+    GeometryBatch geoms(*this);
+    for (auto win : windows) {
+        props.request(win, NetFrameExtents, Cardinal);
+        props.request(win, NetWmDesktop, Cardinal);
+        geoms.request(win);
+    }
+    infos.resize(windows.size());
+    for (size_t i = 0; i < windows.size(); ++i) {
+        WindowInfo &info = infos[i];
+        memset(info.frame, 0, sizeof info.frame);
+        info.desktop = -1;
+        props.cardinals(i * REQUESTS + FRAME, info.frame, 4);
+        props.cardinals(i * REQUESTS + DESKTOP, &info.desktop, 1);
+        info.exists = geoms.geometry(i, &info.geom);
+    }
+}
+
+void
+X11Env::indexClients(std::vector<ClientInfo> &index)
+{
+    std::vector<long> clients;
+    {
+        PropertyBatch list(*this, "client list");
+        list.cardinals(list.request(root, NetClientList, AWindow, 1 << 20), clients);
+    }
+
+    enum { CLASS, NAME, LEGACY_NAME, DESKTOP, WORKDIR, OPACITY, STATE, REQUESTS };
+    PropertyBatch props(*this, "client index");
+    GeometryBatch geoms(*this);
+    for (auto win : clients) {
+        props.request(win, XA_WM_CLASS, XA_STRING);
+        props.request(win, NetWmName, Utf8String);
+        props.request(win, XA_WM_NAME, AnyPropertyType);
+        props.request(win, NetWmDesktop, Cardinal);
+        props.request(win, WorkDir, XA_STRING);
+        props.request(win, NetWmOpacity, Cardinal);
+        props.request(win, NetWmState, XA_ATOM);
+        geoms.request(win);
+    }
+    for (size_t i = 0; i < clients.size(); ++i) {
+        ClientInfo client;
+        client.win = clients[i];
+        if (!geoms.geometry(i, &client.geom))
+            continue; // gone since the WM listed it.
+        // WM_CLASS is the instance name, then the class name, each nul-terminated.
+        std::string wmClass;
+        props.text(i * REQUESTS + CLASS, wmClass);
+        client.instance = wmClass.c_str();
+        if (client.instance.size() < wmClass.size())
+            client.wmClass = wmClass.c_str() + client.instance.size() + 1;
+        if (!props.text(i * REQUESTS + NAME, client.title))
+            props.text(i * REQUESTS + LEGACY_NAME, client.title);
+        client.desktop = -1;
+        props.cardinals(i * REQUESTS + DESKTOP, &client.desktop, 1);
+        props.text(i * REQUESTS + WORKDIR, client.workdir);
+        long opacity;
+        client.opacity = props.cardinals(i * REQUESTS + OPACITY, &opacity, 1)
+            ? double(opacity & 0xffffffff) / std::numeric_limits<uint32_t>::max() : 1.0;
+        props.cardinals(i * REQUESTS + STATE, client.state);
+        index.push_back(client);
+    }
+}
+
+void
+X11Env::watchMonitors()
+{
+    int eventError;
+    RoundTrip wait(*this);
+    if (XRRQueryExtension(display, &randrEventBase, &eventError) == 0) {
+        randrEventBase = 0;
+        return;
+    }
+    XRRSelectInput(display, root,
+            RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask | RROutputChangeNotifyMask);
+}
+
+void
+X11Env::handleEvent(const XEvent &event)
+{
+    if (randrEventBase != 0 && (event.type == randrEventBase + RRScreenChangeNotify
+            || event.type == randrEventBase + RRNotify)) {
+        XRRUpdateConfiguration(const_cast<XEvent *>(&event));
+        if (event.type == randrEventBase + RRScreenChangeNotify) {
+            auto &change = (const XRRScreenChangeNotifyEvent &)event;
+            rootGeom.size.width = change.width;
+            rootGeom.size.height = change.height;
+        }
+        // Everything we know about monitors is worked out again on next use.
+        monitors.clear();
+        refreshRates.clear();
+        usableAreas.clear();
+        ++monitorChanges;
+        return;
+    }
+    switch (event.type) {
+        case PropertyNotify: {
+            Atom atom = event.xproperty.atom;
+            if (atom == NetWorkarea || atom == NetClientList || atom == NetCurrentDesktop
+                    || atom == NetWmStrut || atom == NetWmStrutPartial || atom == NetWmDesktop)
+                usableAreas.clear();
+            if (!prefetching)
+                break;
+            if (event.xproperty.window == root ? atom == NetActiveWindow
+                    : event.xproperty.window == prefetched.win && (atom == NetFrameExtents
+                        || atom == NetWmDesktop || atom == NetWmPid || atom == NetWmState))
+                prefetchStale = true;
+            break;
+        }
+        case ConfigureNotify:
+            if (!prefetching || event.xconfigure.window != prefetched.win)
+                break;
+            // The WM tells us where it has put the window on the root (ICCCM
+            // 4.1.5); the server only says where it is in its frame.
+            if (event.xconfigure.send_event) {
+                prefetched.geom.x = event.xconfigure.x;
+                prefetched.geom.y = event.xconfigure.y;
+                prefetched.geom.size.width = event.xconfigure.width;
+                prefetched.geom.size.height = event.xconfigure.height;
+            } else {
+                prefetchStale = true;
+            }
+            break;
+        case UnmapNotify:
+        case DestroyNotify:
+            // Its ID may be reused for a window we've selected nothing on.
+            if (event.type == DestroyNotify) {
+                eventMasks.erase(event.xdestroywindow.window);
+                placed.erase(event.xdestroywindow.window);
+            }
+            if (prefetching && event.xany.window == prefetched.win)
+                prefetchStale = true;
+            break;
+    }
 }
 
 void
 X11Env::detectMonitors()
 {
+    if (shared != 0 && shared->monitorCount != 0) {
+        monitors.assign(shared->monitors, shared->monitors + shared->monitorCount);
+        return;
+    }
+
     // Try XRandR
     int eventBase, eventError;
+    RoundTrip wait(*this);
     if (XRRQueryExtension(display, &eventBase, &eventError) != 0) {
        int count = 0;
+       RoundTrip wait(*this);
        auto xrandrMonitors = XRRGetMonitors(display, root, True, &count);
        if (count) {
            monitors.resize(count);
@@ -115,19 +1210,24 @@ X11Env::detectMonitors()
        }
     }
     // try Xinerama.
-    if (XineramaQueryExtension(display, &eventBase, &eventError) != 0) {
-        int monitorCount;
-        XineramaScreenInfo *xineramaMonitors = XineramaQueryScreens(display, &monitorCount);
-        if (xineramaMonitors != 0) {
-            monitors.resize(monitorCount);
-            for (int i = 0; i < monitorCount; ++i) {
-                monitors[i].size.width = xineramaMonitors[i].width;
-                monitors[i].size.height = xineramaMonitors[i].height;
-                monitors[i].x = xineramaMonitors[i].x_org;
-                monitors[i].y = xineramaMonitors[i].y_org;
+    static Xinerama xinerama;
+    if (xinerama.queryExtension) {
+        RoundTrip wait(*this);
+        if (xinerama.queryExtension(display, &eventBase, &eventError) != 0) {
+            int monitorCount;
+            RoundTrip wait(*this);
+            XineramaScreenInfo *xineramaMonitors = xinerama.queryScreens(display, &monitorCount);
+            if (xineramaMonitors != 0) {
+                monitors.resize(monitorCount);
+                for (int i = 0; i < monitorCount; ++i) {
+                    monitors[i].size.width = xineramaMonitors[i].width;
+                    monitors[i].size.height = xineramaMonitors[i].height;
+                    monitors[i].x = xineramaMonitors[i].x_org;
+                    monitors[i].y = xineramaMonitors[i].y_org;
+                }
+                XFree(xineramaMonitors);
+                return;
             }
-            XFree(xineramaMonitors);
-            return;
         }
     }
     /* Fallback case is a single monitor occupying the entire root window */
@@ -161,7 +1261,7 @@ std::ostream &operator <<(std::ostream &os, const PartialStrut &ps)
 
 
 void
-PartialStrut::box(const X11Env &x11, Geometry &g)
+PartialStrut::box(const Geometry &root, Geometry &g)
 {
     if (rtop.aligned(g.x, g.size.width) && top > g.y) {
         g.size.height -= top - g.y;
@@ -172,11 +1272,11 @@ PartialStrut::box(const X11Env &x11, Geometry &g)
         g.x = left;
     }
     long winend = g.y + g.size.height;
-    long strutend = x11.rootGeom.size.height - bottom;
+    long strutend = root.size.height - bottom;
     if (rbottom.aligned(g.x, g.size.width) && strutend < winend)
         g.size.height -= winend - strutend;
     winend = g.x + g.size.width;
-    strutend = x11.rootGeom.size.width - right;
+    strutend = root.size.width - right;
     if (rright.aligned(g.y, g.size.height) && strutend < winend)
         g.size.width -= winend - strutend;
 }
@@ -184,13 +1284,18 @@ PartialStrut::box(const X11Env &x11, Geometry &g)
 Window
 X11Env::pick()
 {
+    Span span(*this, "pick");
     Window w = root;
     Cursor c = XCreateFontCursor(display, XC_tcross);
 
-    if (XGrabPointer(display, root, False, ButtonPressMask|ButtonReleaseMask,
-            GrabModeSync, GrabModeAsync, None, c, CurrentTime) != GrabSuccess) {
-        throw "can't grab pointer";
+    int grabbed;
+    {
+        RoundTrip wait(*this);
+        grabbed = XGrabPointer(display, root, False, ButtonPressMask|ButtonReleaseMask,
+                GrabModeSync, GrabModeAsync, None, c, CurrentTime);
     }
+    if (grabbed != GrabSuccess)
+        throw "can't grab pointer";
 
     for (bool done = false; !done;) {
         XEvent event;
@@ -208,22 +1313,22 @@ X11Env::pick()
     }
     XUngrabPointer(display, CurrentTime);
     XFreeCursor(display, c);
+    RoundTrip wait(*this);
     return XmuClientWindow(display, w);
 }
 
 long
 X11Env::desktopForWindow(Window win) const
 {
-    Atom actualType;
     int actualFormat;
     unsigned long itemCount;
-    unsigned long afterBytes;
     unsigned char *prop;
     long rv = -1;
-    
-    auto rc = XGetWindowProperty(display, win, NetWmDesktop, 0,
-            std::numeric_limits<long>::max(), False, Cardinal,
-            &actualType, &actualFormat, &itemCount, &afterBytes, &prop);
+    const SharedClient *client = sharedClient(win);
+    if (client != 0)
+        return client->desktop;
+
+    auto rc = getProperty(win, NetWmDesktop, Cardinal, &actualFormat, &itemCount, &prop);
     if  (rc == 0) {
         if (itemCount == 1)
             rv = *(long *)prop;
@@ -232,22 +1337,71 @@ X11Env::desktopForWindow(Window win) const
     return rv;
 }
 
+static long
+msecNow()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Parent of a process, or 0 if we can't tell.
+static pid_t
+parentOf(pid_t pid)
+{
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    if (!std::getline(stat, line))
+        return 0;
+    // The command name can contain anything, so look after its closing paren.
+    auto paren = line.rfind(')');
+    if (paren == std::string::npos)
+        return 0;
+    char state;
+    pid_t ppid;
+    if (sscanf(line.c_str() + paren + 1, " %c %d", &state, &ppid) != 2)
+        return 0;
+    return ppid;
+}
+
+// Is "ancestor" the same as, or an ancestor of, "pid"?
+static bool
+isAncestor(pid_t ancestor, pid_t pid)
+{
+    for (; pid > 1; pid = parentOf(pid))
+        if (pid == ancestor)
+            return true;
+    return false;
+}
+
+/*
+ * Could the window's owner be what launched the requester? If it has already
+ * exited, we can't tell from the process tree, but its window is going too.
+ */
+static bool
+isLauncher(pid_t owner, pid_t requester)
+{
+    if (requester == 0 || owner <= 0)
+        return false;
+    return isAncestor(owner, requester) || (kill(owner, 0) == -1 && errno == ESRCH);
+}
+
+// Is the window gone, or on its way?
+static bool
+isGoing(const X11Env &x11, Window win)
+{
+    RoundTrip wait(x11);
+    XWindowAttributes attrs;
+    return !XGetWindowAttributes(x11.display, win, &attrs) || attrs.map_state != IsViewable;
+}
+
 Window
-X11Env::active()
+X11Env::activeWindow() const
 {
-    // Find active window from WM.
-    Atom actualType;
     int actualFormat;
     unsigned long itemCount;
-    unsigned long afterBytes;
     unsigned char *prop;
-    // Things like gmrun will exit just after they execute the command they are
-    // asked to run. Give them time to go away before finding the active
-    // window, or else we just end up flinging the dialog box they present
-    usleep(500000);
-    int rc = XGetWindowProperty(display, root, NetActiveWindow,
-            0, std::numeric_limits<long>::max(), False, AWindow,
-            &actualType, &actualFormat, &itemCount, &afterBytes, &prop);
+    int rc = getProperty(root, NetActiveWindow, AWindow, &actualFormat, &itemCount, &prop);
     // XXX: xfce strangely has two items here, second appears to be zero.
     Window rv = 0;
     if (rc == 0) {
@@ -258,8 +1412,81 @@ X11Env::active()
     return rv;
 }
 
+/*
+ * Things like gmrun will exit just after they execute the command they are
+ * asked to run. If the active window is theirs, and going, wait for the focus
+ * to move on, or else we just end up flinging the dialog box they present. A
+ * terminal we were run from is an ancestor too, but its window stays: that's
+ * the one to fling, at once.
+ */
+bool
+X11Env::focusPending(Window win, pid_t requester) const
+{
+    if (win == 0)
+        return true;
+    const SharedClient *client = sharedClient(win);
+    if (client != 0)
+        return isLauncher(client->pid, requester) && isGoing(*this, win);
+    int actualFormat;
+    unsigned long itemCount;
+    unsigned char *prop;
+    bool launcher = false;
+    if (getProperty(win, NetWmPid, Cardinal, &actualFormat, &itemCount, &prop) == 0) {
+        if (actualFormat == 32 && itemCount == 1)
+            launcher = isLauncher(*(long *)prop, requester);
+        XFree(prop);
+    }
+    return launcher && isGoing(*this, win);
+}
+
+Window
+X11Env::active(pid_t requester, int maxWait)
+{
+    Span span(*this, "active");
+    /*
+     * The property can change while it settles: hear about changes from
+     * before we read it, and wait until it has been quiet for a while.
+     */
+    constexpr int QUIET = 50;
+    selectInput(root, PropertyChangeMask);
+    long deadline = msecNow() + maxWait;
+    long quietUntil = 0;
+    // Once it changes, the publisher's or our prefetched idea of it is out of date.
+    if (prefetching)
+        catchUp();
+    Window rv;
+    if (shared != 0)
+        rv = shared->active;
+    else if (prefetching && !prefetchStale)
+        rv = prefetched.win;
+    else
+        rv = activeWindow();
+    bool pending = focusPending(rv, requester);
+
+    for (;;) {
+        bool changed = false;
+        XEvent event;
+        while (XCheckTypedWindowEvent(display, root, PropertyNotify, &event))
+            if (event.xproperty.atom == NetActiveWindow)
+                changed = true;
+        long now = msecNow();
+        if (changed) {
+            rv = activeWindow();
+            pending = focusPending(rv, requester);
+            quietUntil = now + QUIET;
+        }
+        long wait = (pending ? deadline : std::min(quietUntil, deadline)) - now;
+        if (wait <= 0)
+            return rv;
+        pollfd pfd;
+        pfd.fd = ConnectionNumber(display);
+        pfd.events = POLLIN;
+        poll(&pfd, 1, wait);
+    }
+}
+
 void
-X11Env::updateState(Window win, const Atom stateitem, StateUpdateAction action) const
+X11Env::sendState(Window win, const Atom stateitem, StateUpdateAction action, Atom second) const
 {
     XEvent e;
     XClientMessageEvent &ec = e.xclient;
@@ -272,9 +1499,24 @@ X11Env::updateState(Window win, const Atom stateitem, StateUpdateAction action)
     ec.format = 32;
     ec.data.l[0] = action;
     ec.data.l[1] = stateitem;
-    ec.data.l[2] = stateitem == NetWmStateMaximizedHoriz ? NetWmStateMaximizedVert : 0 ;
+    ec.data.l[2] = second;
     ec.data.l[3] = 1;
     if (!XSendEvent(display, root, False, SubstructureRedirectMask|SubstructureNotifyMask, &e))
         std::cerr << "can't go fullscreen" << std::endl;
-    XSync(display, False);
+}
+
+void
+X11Env::sendDesktop(Window win, long desktop) const
+{
+    XEvent e;
+    XClientMessageEvent &ec = e.xclient;
+    memset(&e, 0, sizeof e);
+    ec.type = ClientMessage;
+    ec.send_event = True;
+    ec.message_type = NetWmDesktop;
+    ec.window = win;
+    ec.format = 32;
+    ec.data.l[0] = desktop;
+    ec.data.l[1] = 2; // from a pager, or the like: the user asked for it.
+    XSendEvent(display, root, False, SubstructureRedirectMask|SubstructureNotifyMask, &e);
 }
@@ -0,0 +1,726 @@
+#include "fling.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <memory>
+#include <sstream>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/*
+ * A resident fling keeps one X connection and X11Env alive, and runs command
+ * lines sent to it over a UNIX socket. A request is whichever of FLING_STATS
+ * and FLING_TRACE the client has set, as NAME=value, then an empty string,
+ * then the client's argv, each string terminated by a NUL, ended by the
+ * client shutting down its write side. The reply is the command's exit
+ * status as an int, then what it wrote to cout, then what it wrote to cerr
+ * and clog, each section a uint32_t length followed by that many bytes.
+ */
+
+static volatile sig_atomic_t stopping;
+// How long monitor changes must settle before we put windows back in place.
+constexpr int SETTLE = 500; // milliseconds
+
+
+void
+rememberPlacement(X11Env &x11, Window win, int screen, const std::string &location)
+{
+    if (!resident)
+        return;
+    auto &monitors = x11.getMonitors();
+    if (screen < 0 || size_t(screen) >= monitors.size())
+        return;
+    x11.placed[win] = X11Env::Placed { location, screen, monitors[screen] };
+    // Hear when it's destroyed, so a window that reuses its ID isn't flung for it.
+    x11.selectInput(win, StructureNotifyMask);
+}
+
+static bool
+sameGeometry(const Geometry &l, const Geometry &r)
+{
+    return l.x == r.x && l.y == r.y
+        && l.size.width == r.size.width && l.size.height == r.size.height;
+}
+
+/*
+ * The monitors have changed: windows whose monitor is still where it was
+ * stay put. The rest are flung again, with the control string they were
+ * last flung with, onto the monitor that took their old one's place, all
+ * in one batch.
+ */
+static void
+replaceWindows(X11Env &x11)
+{
+    auto &monitors = x11.getMonitors();
+    auto &windows = x11.placed;
+    std::vector<Placement> placements;
+    for (auto &f : windows) {
+        int screen = -1;
+        for (size_t i = 0; i < monitors.size(); ++i)
+            if (sameGeometry(monitors[i], f.second.monitor))
+                screen = i;
+        if (screen != -1) {
+            f.second.screen = screen;
+            continue;
+        }
+        Placement p;
+        p.win = f.first;
+        p.location = f.second.location;
+        p.screen = std::min(f.second.screen, int(monitors.size()) - 1);
+        placements.push_back(p);
+    }
+    if (placements.empty())
+        return;
+    std::clog << "monitors changed: replacing " << placements.size() << " windows" << std::endl;
+
+    // Windows that have gone away are forgotten, and the rest remembered afresh.
+    for (auto &p : placements)
+        windows.erase(p.win);
+    try {
+        placeWindows(x11, placements, -1, MoveOptions());
+    }
+    catch (const char *msg) {
+        std::clog << msg << std::endl;
+    }
+}
+
+static void
+onSignal(int)
+{
+    stopping = 1;
+}
+
+// A bad window id from a client must not take the daemon down with it.
+static int
+onXError(Display *display, XErrorEvent *error)
+{
+    char text[256];
+    XGetErrorText(display, error->error_code, text, sizeof text);
+    std::cerr << "X error: " << text << std::endl;
+    return 0;
+}
+
+std::string
+socketPath(const char *displayName)
+{
+    const char *override = getenv("FLING_SOCKET");
+    if (override && displayName == 0)
+        return override;
+
+    std::string display = XDisplayName(displayName);
+    for (auto &c : display)
+        if (c == '/')
+            c = '_';
+
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime && *runtime)
+        return std::string(runtime) + "/fling-" + display;
+    return "/tmp/fling-" + std::to_string(getuid()) + "-" + display;
+}
+
+static bool
+makeAddress(sockaddr_un &addr, const std::string &path)
+{
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof addr.sun_path)
+        return false;
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+
+static bool
+writeAll(int fd, const char *data, size_t len)
+{
+    while (len != 0) {
+        ssize_t rc = write(fd, data, len);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return false;
+        data += rc;
+        len -= rc;
+    }
+    return true;
+}
+
+static bool
+readAll(int fd, std::string &data)
+{
+    char buf[4096];
+    for (;;) {
+        ssize_t rc = read(fd, buf, sizeof buf);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc < 0)
+            return false;
+        if (rc == 0)
+            return true;
+        data.append(buf, rc);
+    }
+}
+
+int
+clientMain(int argc, char *argv[])
+{
+    sockaddr_un addr;
+    if (!makeAddress(addr, socketPath()))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    if (connect(fd, (sockaddr *)&addr, sizeof addr) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // The daemon has its own working directory: make paths it's given absolute.
+    char cwd[PATH_MAX];
+    bool haveCwd = getcwd(cwd, sizeof cwd) != 0;
+
+    // The command's instrumentation is ours to ask for, not the daemon's.
+    std::string request;
+    for (const char *name : { "FLING_STATS", "FLING_TRACE" }) {
+        const char *value = getenv(name);
+        if (value == 0)
+            continue;
+        request.append(name).append("=");
+        if (strcmp(name, "FLING_TRACE") == 0 && *value != '/' && haveCwd)
+            request.append(cwd).append("/");
+        request.append(value, strlen(value) + 1);
+    }
+    request.append(1, 0);
+
+    for (int i = 0; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *path = 0;
+        if (i > 0 && (strcmp(argv[i - 1], "--save") == 0 || strcmp(argv[i - 1], "--restore") == 0))
+            path = arg;
+        else if (strncmp(arg, "--save=", 7) == 0)
+            path = arg + 7;
+        else if (strncmp(arg, "--restore=", 10) == 0)
+            path = arg + 10;
+        if (path != 0 && *path != '/' && haveCwd)
+            request.append(arg, path).append(cwd).append("/").append(path, strlen(path) + 1);
+        else
+            request.append(arg, strlen(arg) + 1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    std::string reply;
+    bool ok = writeAll(fd, request.data(), request.size())
+            && shutdown(fd, SHUT_WR) == 0
+            && readAll(fd, reply)
+            && reply.size() >= sizeof (int);
+    close(fd);
+    if (!ok) {
+        std::clog << "lost connection to fling daemon" << std::endl;
+        return 1;
+    }
+    // The reply is the status, then what went to stdout and to stderr, each length-prefixed.
+    int status;
+    memcpy(&status, reply.data(), sizeof status);
+    size_t off = sizeof status;
+    for (int out : { STDOUT_FILENO, STDERR_FILENO }) {
+        uint32_t len;
+        if (reply.size() - off < sizeof len)
+            break;
+        memcpy(&len, reply.data() + off, sizeof len);
+        off += sizeof len;
+        len = std::min(size_t(len), reply.size() - off);
+        writeAll(out, reply.data() + off, len);
+        off += len;
+    }
+    return status;
+}
+
+/*
+ * Listen on "path", taking it over from any daemon that died without
+ * removing it. Returns -1, having said why, if we can't.
+ */
+static int
+listenOn(const std::string &path)
+{
+    sockaddr_un addr;
+    if (!makeAddress(addr, path)) {
+        std::clog << "bad socket path " << path << std::endl;
+        return -1;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        std::clog << "can't create socket: " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    // A socket nobody answers on was left behind by a dead daemon.
+    if (connect(listener, (sockaddr *)&addr, sizeof addr) == 0) {
+        std::clog << "fling daemon already running on " << path << std::endl;
+        close(listener);
+        return -1;
+    }
+    close(listener);
+    unlink(path.c_str());
+
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t oldmask = umask(077);
+    int rc = bind(listener, (sockaddr *)&addr, sizeof addr);
+    umask(oldmask);
+    if (rc == -1 || listen(listener, 16) == -1) {
+        std::clog << "can't listen on " << path << ": " << strerror(errno) << std::endl;
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+// What every resident process does before it starts serving.
+static void
+becomeResident()
+{
+    resident = true;
+    XSetErrorHandler(onXError);
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = onSignal;
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+}
+
+/*
+ * Each display a resident fling serves has its own X11Env and hotkeys, and
+ * listens on the socket its own daemon would, so clients find it just the
+ * same. One epoll loop serves every display's socket and X connection.
+ */
+struct Session {
+    std::string name;
+    std::string path; // where we listen for commands for it.
+    Display *display = 0;
+    X11Env *x11 = 0;
+    std::unique_ptr<X11Env> owned; // if we opened the display ourselves.
+    std::unique_ptr<Hotkeys> hotkeys;
+    int listener = -1; // or -1 once we've stopped serving it.
+    unsigned long monitorChanges = 0;
+    long settle = 0; // when to replace windows after monitors change (nsecNow()), or 0.
+    bool lost = false; // its X server has gone.
+};
+
+// What an epoll event is for: the session's index, and which of its fds.
+enum { LISTENER, CONNECTION, BINDINGS, SOURCES };
+
+/*
+ * The X server has gone. Xlib calls this rather than exiting, and fails
+ * anything else we ask of the display: we end the session when we're next
+ * back in the loop.
+ */
+static void
+onLostDisplay(Display *, void *session)
+{
+    ((Session *)session)->lost = true;
+}
+
+// For a hotkey: nobody to reply to, so say what went wrong in our own log.
+static void
+runLogged(X11Env &x11, int argc, char *argv[])
+{
+    try {
+        runCommand(x11, argc, argv);
+    }
+    catch (const char *msg) {
+        std::clog << msg << std::endl;
+    }
+    XSync(x11, False);
+}
+
+static void
+runAndReply(X11Env &x11, int argc, char *argv[], int fd)
+{
+    // Send everything the command says back to the client, its stdout kept apart.
+    std::ostringstream output, errors;
+    auto coutBuf = std::cout.rdbuf(output.rdbuf());
+    auto cerrBuf = std::cerr.rdbuf(errors.rdbuf());
+    auto clogBuf = std::clog.rdbuf(errors.rdbuf());
+    int status;
+    try {
+        status = runCommand(x11, argc, argv);
+    }
+    catch (const char *msg) {
+        std::clog << msg << "\n";
+        status = 1;
+    }
+    std::cout.rdbuf(coutBuf);
+    std::cerr.rdbuf(cerrBuf);
+    std::clog.rdbuf(clogBuf);
+
+    // Anything the command left unsent goes out before we take the next one.
+    XSync(x11, False);
+
+    if (!writeAll(fd, (const char *)&status, sizeof status))
+        return;
+    for (auto &text : { output.str(), errors.str() }) {
+        uint32_t len = text.size();
+        if (!writeAll(fd, (const char *)&len, sizeof len) || !writeAll(fd, text.data(), len))
+            return;
+    }
+}
+
+/*
+ * Waiting for a click or keys mustn't hold up hotkeys, or other displays, so
+ * such a command runs in a child, on an X connection of its own, and replies
+ * to "fd" (if not -1) itself. Returns true if it did.
+ */
+static bool
+detach(X11Env &x11, int argc, char *argv[], int fd)
+{
+    if (!waitsForUser(argc, argv))
+        return false;
+    pid_t pid = fork();
+    if (pid == -1) {
+        std::clog << "can't fork: " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (pid != 0)
+        return true;
+
+    // Leave the parent's connections alone: only exit without tidying up.
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, 0);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    Display *display = XOpenDisplay(DisplayString(x11.display));
+    if (display != 0) {
+        X11Env own(display);
+        own.resetStats(x11.instrument ? x11.stats.c_str() : 0,
+                x11.tracePath.empty() ? 0 : x11.tracePath.c_str());
+        if (fd == -1)
+            runLogged(own, argc, argv);
+        else
+            runAndReply(own, argc, argv, fd);
+    }
+    _exit(0);
+}
+
+void
+runResident(X11Env &x11, int argc, char *argv[])
+{
+    if (!detach(x11, argc, argv, -1))
+        runLogged(x11, argc, argv);
+}
+
+static void
+serve(X11Env &x11, int fd)
+{
+    // Don't let a client that never finishes its request wedge the daemon.
+    timeval timeout = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+    std::string request;
+    if (!readAll(fd, request) || request.empty() || request.back() != 0) {
+        std::clog << "malformed request" << std::endl;
+        return;
+    }
+
+    // Find who's asking, so active() can tell if the focus is still theirs.
+    ucred cred;
+    socklen_t credlen = sizeof cred;
+    requester = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == 0 ? cred.pid : 0;
+
+    const char *stats = 0, *trace = 0;
+    size_t off = 0;
+    for (; off < request.size() && request[off] != 0; off += strlen(&request[off]) + 1) {
+        if (strncmp(&request[off], "FLING_STATS=", 12) == 0)
+            stats = &request[off + 12];
+        else if (strncmp(&request[off], "FLING_TRACE=", 12) == 0)
+            trace = &request[off + 12];
+    }
+    std::vector<char *> args;
+    for (++off; off < request.size(); off += strlen(&request[off]) + 1)
+        args.push_back(&request[off]);
+    if (args.empty()) {
+        std::clog << "malformed request" << std::endl;
+        return;
+    }
+    args.push_back(0);
+
+    x11.resetStats(stats, trace);
+    if (!detach(x11, args.size() - 1, &args[0], fd))
+        runAndReply(x11, args.size() - 1, &args[0], fd);
+}
+
+static void
+watch(int epoll, int fd, size_t session, int source)
+{
+    epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN;
+    event.data.u64 = session * SOURCES + source;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Start serving "session", whose display is open. Returns false, having said why, if we can't.
+static bool
+startSession(int epoll, size_t index, Session &session, bool watching)
+{
+    session.path = socketPath(session.name.c_str());
+    session.listener = listenOn(session.path);
+    if (session.listener == -1)
+        return false;
+    XSetIOErrorExitHandler(session.display, onLostDisplay, &session);
+    session.hotkeys.reset(new Hotkeys(*session.x11, watching));
+    session.x11->watchMonitors();
+    session.x11->watchActive();
+    session.monitorChanges = session.x11->monitorChanges;
+    watch(epoll, session.listener, index, LISTENER);
+    watch(epoll, ConnectionNumber(session.display), index, CONNECTION);
+    if (session.hotkeys->fd() != -1)
+        watch(epoll, session.hotkeys->fd(), index, BINDINGS);
+    XSync(session.display, False);
+    return true;
+}
+
+static void
+endSession(int epoll, Session &session)
+{
+    epoll_ctl(epoll, EPOLL_CTL_DEL, ConnectionNumber(session.display), 0);
+    epoll_ctl(epoll, EPOLL_CTL_DEL, session.listener, 0);
+    if (session.hotkeys->fd() != -1)
+        epoll_ctl(epoll, EPOLL_CTL_DEL, session.hotkeys->fd(), 0);
+    close(session.listener);
+    unlink(session.path.c_str());
+    session.hotkeys.reset();
+    session.listener = -1;
+}
+
+/*
+ * Handle everything Xlib has read from a display, prefetch its active
+ * window, and note monitor changes.
+ */
+static void
+drain(Session &session)
+{
+    X11Env &x11 = *session.x11;
+    do {
+        while (!session.lost && XPending(x11)) {
+            XEvent event;
+            XNextEvent(x11, &event);
+            x11.handleEvent(event);
+            session.hotkeys->handleEvent(event);
+        }
+    } while (!session.lost && x11.prefetch());
+    // RandR sends changes in bursts: wait for them to stop before acting.
+    if (x11.monitorChanges != session.monitorChanges) {
+        session.monitorChanges = x11.monitorChanges;
+        session.settle = nsecNow() + SETTLE * 1000000L;
+    }
+}
+
+// Serve the sessions that started until they've all gone, or we're killed.
+static void
+serveSessions(int epoll, std::vector<Session> &sessions)
+{
+    // Hold signals back except while we wait, so we can't miss one.
+    sigset_t blocked, waiting;
+    sigemptyset(&blocked);
+    for (int sig : { SIGINT, SIGTERM })
+        sigaddset(&blocked, sig);
+    sigprocmask(SIG_BLOCK, &blocked, &waiting);
+
+    std::vector<epoll_event> events(64);
+    for (;;) {
+        size_t live = 0;
+        for (auto &session : sessions) {
+            if (session.listener == -1)
+                continue;
+            if (session.lost) {
+                std::clog << session.name << ": display has gone away" << std::endl;
+                endSession(epoll, session);
+                continue;
+            }
+            drain(session);
+            ++live;
+        }
+        // Children that ran commands for us have nothing to tell us.
+        while (waitpid(-1, 0, WNOHANG) > 0)
+            ;
+        if (live == 0 || stopping)
+            break;
+
+        // Sleep until the soonest display whose monitors have settled.
+        long now = nsecNow(), wake = -1;
+        for (auto &session : sessions)
+            if (session.listener != -1 && session.settle != 0) {
+                long wait = std::max(0L, (session.settle - now + 999999) / 1000000);
+                wake = wake == -1 ? wait : std::min(wake, wait);
+            }
+        int ready = epoll_pwait(epoll, &events[0], events.size(), wake, &waiting);
+
+        for (int i = 0; i < ready; ++i) {
+            Session &session = sessions[events[i].data.u64 / SOURCES];
+            if (session.listener == -1 || session.lost)
+                continue;
+            switch (events[i].data.u64 % SOURCES) {
+                case LISTENER: {
+                    int fd = accept4(session.listener, 0, 0, SOCK_CLOEXEC);
+                    if (fd != -1) {
+                        serve(*session.x11, fd);
+                        close(fd);
+                    }
+                    break;
+                }
+                case BINDINGS:
+                    // The one watching session reloads itself; the rest follow.
+                    if (session.hotkeys->changed())
+                        for (auto &other : sessions)
+                            if (&other != &session && other.listener != -1 && !other.lost)
+                                other.hotkeys->load();
+                    break;
+            }
+        }
+
+        now = nsecNow();
+        for (auto &session : sessions) {
+            if (session.listener == -1 || session.lost || session.settle == 0 || session.settle > now)
+                continue;
+            session.settle = 0;
+            replaceWindows(*session.x11);
+            XSync(*session.x11, False);
+        }
+    }
+    for (auto &session : sessions)
+        if (session.listener != -1)
+            endSession(epoll, session);
+}
+
+int
+daemonMain(X11Env &x11)
+{
+    becomeResident();
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll == -1) {
+        std::clog << "can't create epoll: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    std::vector<Session> sessions(1);
+    Session &session = sessions[0];
+    session.display = x11.display;
+    session.name = DisplayString(x11.display);
+    session.x11 = &x11;
+    int rc = 1;
+    if (startSession(epoll, 0, session, true)) {
+        serveSessions(epoll, sessions);
+        rc = session.lost ? 1 : 0;
+    }
+    close(epoll);
+    return rc;
+}
+
+int
+publishMain(X11Env &x11)
+{
+    becomeResident();
+    x11.watchMonitors();
+    Publisher publisher(x11);
+    XSync(x11, False);
+
+    pollfd fd;
+    fd.fd = ConnectionNumber(x11.display);
+    fd.events = POLLIN;
+    while (!stopping) {
+        while (XPending(x11)) {
+            XEvent event;
+            XNextEvent(x11, &event);
+            x11.handleEvent(event);
+            publisher.handleEvent(event);
+        }
+        // Publish when due, even if events keep arriving.
+        if (publisher.timeout() == 0) {
+            publisher.publish();
+            // Make sure we hear about windows that have appeared since.
+            XSync(x11, False);
+            continue;
+        }
+        poll(&fd, 1, publisher.timeout());
+    }
+    return 0;
+}
+
+// Resident set size, from /proc/self/statm, in KiB.
+static long
+residentKiB()
+{
+    long pages = 0, rss = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f != 0) {
+        if (fscanf(f, "%ld %ld", &pages, &rss) != 2)
+            rss = 0;
+        fclose(f);
+    }
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * A controller is one resident fling for many displays, for hosts running an
+ * X server per remote desktop, so they share one process, rather than each
+ * having a daemon of its own. When a display's server goes away, the others
+ * carry on. One of the displays watches the bindings file for them all.
+ */
+int
+controllerMain(int count, char *displays[])
+{
+    if (count == 0) {
+        std::clog << "usage: fling --controller <display> ..." << std::endl;
+        return 1;
+    }
+    becomeResident();
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll == -1) {
+        std::clog << "can't create epoll: " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    // What a daemon costs before it opens its display, and what each display adds.
+    long before = residentKiB();
+    std::vector<Session> sessions(count);
+    size_t opened = 0;
+    for (int i = 0; i < count; ++i) {
+        Session &session = sessions[i];
+        session.name = displays[i];
+        session.display = XOpenDisplay(displays[i]);
+        if (session.display == 0) {
+            std::clog << session.name << ": failed to open display" << std::endl;
+            continue;
+        }
+        session.owned.reset(new X11Env(session.display));
+        session.x11 = session.owned.get();
+        if (!startSession(epoll, i, session, opened == 0)) {
+            session.owned.reset();
+            XCloseDisplay(session.display);
+            continue;
+        }
+        ++opened;
+    }
+    if (opened == 0) {
+        close(epoll);
+        return 1;
+    }
+    long total = residentKiB();
+    long each = (total - before) / opened;
+    std::clog << "controlling " << opened << " displays in " << total
+        << " KiB: as separate daemons, about " << opened * (before + each) << " KiB" << std::endl;
+
+    serveSessions(epoll, sessions);
+    for (auto &session : sessions) {
+        if (session.owned == 0)
+            continue;
+        session.owned.reset();
+        XCloseDisplay(session.display);
+    }
+    close(epoll);
+    return 0;
+}
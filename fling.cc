@@ -1,7 +1,10 @@
-#include "wmhack.h"
+#include "fling.h"
+#include <errno.h>
+#include <getopt.h>
 #include <poll.h>
 #include <X11/Xatom.h>
 #include <X11/keysymdef.h>
+#include <X11/extensions/shape.h>
 #include <sys/time.h>
 #include <string>
 #include <string.h>
@@ -10,8 +13,11 @@
 
 static int intarg() { return atoi(optarg); } // XXX: use strtol and invoke usage()
 static bool nodo = false;
-static unsigned int border = 2;
-static bool glide = true;
+static MoveOptions moveOptions;
+static int verbose = 0;
+static int activeWait = 500;
+bool resident = false;
+pid_t requester;
 
 constexpr int MAXIDLE = 3000;
 
@@ -20,191 +26,143 @@ static void
 usage(std::ostream &stream)
 {
     stream << readme_txt;
+    if (resident)
+        throw "invalid command line";
     exit(1);
 }
 
-static void
-adjustForStruts(const X11Env &x11, Geometry *g, long targetDesktop)
+// A number in [low, high]: anything else, including nan, is a usage error.
+static double
+realarg(double low, double high)
 {
-    Atom actualType;
-    int actualFormat;
-    unsigned long itemCount;
-    unsigned long afterBytes;
-    unsigned char *winlist;
-    // get a list of all clients, so we can adjust monitor sizes for extents.
-    int rc = XGetWindowProperty(x11, x11.root, x11.NetClientList,
-            0, std::numeric_limits<long>::max(), False, x11.AWindow,
-            &actualType, &actualFormat, &itemCount, &afterBytes, &winlist);
-    if (rc != 0 || actualFormat != 32 || itemCount <= 0 ) {
-        std::cerr << "can't list clients to do strut processing" << std::endl;
-        return;
-    }
+    char *end;
+    double value = strtod(optarg, &end);
+    if (end == optarg || *end != '\0' || !(value >= low && value <= high))
+        usage(std::cerr);
+    return value;
+}
 
-    Window *w = (Window *)winlist;
-    for (size_t i = itemCount; i-- > 0;) {
-        auto clipDesktop = x11.desktopForWindow(w[i]);
-        unsigned char *prop;
-        if (clipDesktop == targetDesktop || clipDesktop == -1 || targetDesktop == -1) {
-            rc = XGetWindowProperty(x11, w[i], x11.NetWmStrutPartial,
-                0, std::numeric_limits<long>::max(), False, x11.Cardinal,
-                &actualType, &actualFormat, &itemCount, &afterBytes, &prop);
-            if (rc == 0) {
-                if (itemCount == 12 && actualFormat == 32) {
-                    PartialStrut *strut = (PartialStrut *)prop;
-                    strut->box(x11, *g);
-                }
-                XFree(prop);
-            } else {
-                unsigned char *prop;
-                rc = XGetWindowProperty(x11, w[i], x11.NetWmStrut,
-                    0, std::numeric_limits<long>::max(), False, x11.Cardinal,
-                    &actualType, &actualFormat, &itemCount, &afterBytes, &prop);
-                if (rc == 0) {
-                    std::clog << "TODO: deal with legacy strut\n";
-                    XFree(prop);
-                }
-            }
-        }
-    }
-    XFree(winlist);
+// As realarg, for a whole number.
+static long
+wholearg(long low, long high)
+{
+    char *end;
+    errno = 0;
+    long value = strtol(optarg, &end, 10);
+    if (end == optarg || *end != '\0' || errno != 0 || value < low || value > high)
+        usage(std::cerr);
+    return value;
 }
 
 static void
-setOpacityRaw(const X11Env &x11, Window w, unsigned long opacity)
+setOpacityRaw(const X11Env &x11, Transaction &changes, Window w, unsigned long opacity)
 {
-    XChangeProperty(x11, w, x11.NetWmOpacity, XA_CARDINAL, 32, PropModeReplace,
-          (unsigned char *)&opacity, 1);
-    XFlush(x11);
+    changes.property(w, x11.NetWmOpacity, XA_CARDINAL, 32, &opacity, 1);
 }
 
 static void
-setOpacity(const X11Env &x11, Window w, double opacity)
+setOpacity(const X11Env &x11, Transaction &changes, Window w, double opacity)
 {
-    setOpacityRaw(x11, w, opacity * std::numeric_limits<uint32_t>::max());
+    setOpacityRaw(x11, changes, w, opacity * std::numeric_limits<uint32_t>::max());
 }
 
 static double
 getOpacity(const X11Env &x11, Window w)
 {
-
-    Atom actualType;
     int actualFormat;
     unsigned char *property;
-    unsigned long items, size;
+    unsigned long items;
 
-    int rc = XGetWindowProperty(x11, w, x11.NetWmOpacity, 0, 1, False, XA_CARDINAL,
-            &actualType, &actualFormat, &items, &size, &property);
+    int rc = x11.getProperty(w, x11.NetWmOpacity, XA_CARDINAL, &actualFormat,
+            &items, &property, 1);
     unsigned long propertyValue = rc == 0 && items == 1 ? *(unsigned long *)property : std::numeric_limits<uint32_t>::max();
+    if (rc == 0)
+        XFree(property);
     propertyValue &= 0xffffffff; // XXX: Seems to get sign extended.
     return double(propertyValue) / std::numeric_limits<uint32_t>::max();
 }
 
 
 static void
-setOpacityDelta(const X11Env &x11, Window w, double opacity)
+setOpacityDelta(const X11Env &x11, Transaction &changes, Window w, double opacity)
 {
-    setOpacity(x11, w, std::max(0.0, std::min(1.0, getOpacity(x11, w) + opacity)));
+    setOpacity(x11, changes, w, std::max(0.0, std::min(1.0, getOpacity(x11, w) + opacity)));
 }
 
 
 static void
-setWorkdir(const X11Env &x11, Window w, const char *value)
+setWorkdir(const X11Env &x11, Transaction &changes, Window w, const char *value)
 {
-    XChangeProperty(x11, w, x11.WorkDir, XA_STRING, 8, PropModeReplace,
-               (const unsigned char *)value, strlen(value));
-    XFlush(x11);
+    changes.property(w, x11.WorkDir, XA_STRING, 8, value, strlen(value));
+}
+
+// -m maximizes both ways: the vertical goes along with the horizontal.
+static Atom
+maximizedWith(const X11Env &x11, Atom atom)
+{
+    return atom == x11.NetWmStateMaximizedHoriz ? x11.NetWmStateMaximizedVert : None;
+}
+
+/*
+ * Apply a command to every window a selector matched, sending it all before
+ * waiting for anything. The control string, if any, places the windows as a
+ * layout does, each on its own monitor unless we're given one.
+ */
+static void
+updateWindows(X11Env &x11, const std::vector<ClientInfo> &matches,
+      const std::set<Atom> &toggles, X11Env::StateUpdateAction action,
+      double opacity, double opacityDelta, const char *workdir,
+      const char *location, int screen)
+{
+    x11.phase("toggles");
+    Transaction changes(x11);
+    for (auto &client : matches) {
+        std::clog << "updating " << client.win << "\n";
+        if (opacity >= 0.0)
+            setOpacity(x11, changes, client.win, opacity);
+        if (opacityDelta != 0.0)
+            setOpacity(x11, changes, client.win,
+                  std::max(0.0, std::min(1.0, client.opacity + opacityDelta)));
+        if (workdir != 0)
+            setWorkdir(x11, changes, client.win, workdir);
+        for (auto atom : toggles)
+            changes.state(client.win, atom, action, maximizedWith(x11, atom));
+    }
+    // Without a move to follow, wait for them, as the move would.
+    changes.commit(location == 0);
+    if (location == 0)
+        return;
+
+    std::vector<Placement> placements;
+    for (auto &client : matches) {
+        Placement p;
+        p.win = client.win;
+        p.location = location;
+        p.screen = screen != -1 ? screen : x11.monitorAt(client.geom);
+        placements.push_back(p);
+    }
+    placeWindows(x11, placements, screen, moveOptions);
 }
 
-void
-resizeWindow(X11Env &x11,
-      long desktop, Geometry &geom,
-      Window win,
+// Send "changes" along with the move.
+static void
+resizeWindow(X11Env &x11, Transaction &changes,
+      const Geometry &usable, Geometry &geom,
+      Window win, const Geometry &from,
       unsigned *border,
       const long *frame,
       const char *location)
 {
-    char curChar;
-
-    for (const char *path = location; (curChar = *path) != 0; ++path) {
-        double num = 1, denom = 2;
-        if (isdigit(curChar) || curChar == '.') {
-            char *newpath;
-            num = 1;
-            denom = strtod(path, &newpath);
-            path = newpath;
-            curChar = *path;
-            if (curChar == '/') {
-               num = denom;
-               denom = strtod(path + 1, &newpath);
-               path = newpath;
-               curChar = *path;
-            }
-        }
-
-        switch (curChar) {
-            case 'b':
-                *border = denom;
-                break;
-            case 'r':
-                // move to right
-                geom.x += geom.size.width - geom.size.width * (num / denom);
-                // and then...
-            case 'l':
-                // cut out right hand side.
-                geom.size.width = geom.size.width * num / denom;
-                break;
-            case 'd':
-                geom.y += geom.size.height - geom.size.height * (num / denom);
-                // and then...
-            case 'u':
-                geom.size.height = geom.size.height * (num / denom);
-                break;
-            case 'h': {
-                // reduce horizontal size and centre
-                int newsize = geom.size.width * (num / denom);
-                geom.x += (geom.size.width - newsize) / 2;
-                geom.size.width = newsize;
-                break;
-            }
-            case 'v': {
-                // reduce vertical size and centre
-                int newsize = geom.size.height * (num / denom);
-                geom.y += (geom.size.height - newsize) / 2;
-                geom.size.height = newsize;
-                break;
-            }
-            default:
-                usage(std::cerr);
-        }
-    }
-    adjustForStruts(x11, &geom, desktop);
-
-    // Adjust the geometry downwards to account for the frame around the window, and our border.
-    geom.size.width -= frame[0] + frame[1] + *border * 2;
-    geom.size.height -= frame[2] + frame[3] + *border * 2;
-    geom.x += frame[0] + *border;
-    geom.y += frame[2] + *border;
-
-    Geometry oldgeom = x11.getGeometry(win);
-    int duration = 150000;
-    int sleeptime = 500000 / 60;
-    int iters = duration / sleeptime;
-    if (glide) {
-#define update(f) next.f = (oldgeom.f * (iters - i) + geom.f * i) / iters
-        for (auto i = 1;; ++i) {
-              Geometry next;
-              update(size.width);
-              update(size.height);
-              update(x);
-              update(y);
-              x11.setGeometry(win, next);
-              if (i == iters)
-                 break;
-              usleep(sleeptime);
-        }
-#undef update 
+    if (!locate(usable, geom, border, frame, location))
+        usage(std::cerr);
+    if (moveOptions.glide) {
+        Glide motion(x11, moveOptions.glideOptions);
+        motion.add(win, from, geom);
+        changes.commit();
+        motion.run();
     } else {
-        x11.setGeometry(win, geom);
+        changes.geometry(win, geom);
+        changes.commit(true);
     }
 }
 
@@ -221,12 +179,261 @@ msecDiff(const timeval &l, const timeval &r)
    return usec / 1000 + sec * 1000;
 }
 
+static const struct {
+    KeySym sym;
+    const char *operation;
+} keyOperations[] = {
+   { XK_Up, "u" },
+   { XK_Down, "d" },
+   { XK_Left, "l" },
+   { XK_Right, "r" },
+
+   { XK_KP_8, "u" },
+   { XK_KP_2, "d" },
+   { XK_KP_4, "l" },
+   { XK_KP_6, "r" },
+
+   { XK_KP_7, "ul" },
+   { XK_KP_9, "ur" },
+   { XK_KP_1, "dl" },
+   { XK_KP_3, "dr" },
+
+   { XK_KP_Up, "u" },
+   { XK_KP_Down, "d" },
+   { XK_KP_Left, "l" },
+   { XK_KP_Right, "r" },
+
+   { XK_KP_Home, "ul" },
+   { XK_KP_Page_Up, "ur" },
+   { XK_KP_End, "dl" },
+   { XK_KP_Page_Down, "dr" },
+
+   // Put the window where the outline is.
+   { XK_Return, "" },
+   { XK_KP_Enter, "" }
+};
+
+// An override-redirect window, shaped to a frame, to stand in for the window.
+static Window
+createOutline(X11Env &x11)
+{
+    int eventBase, errorBase;
+    RoundTrip wait(x11);
+    if (!XShapeQueryExtension(x11, &eventBase, &errorBase)) {
+        std::clog << "no SHAPE extension, moving the window itself" << std::endl;
+        return None;
+    }
+    XSetWindowAttributes attrs;
+    attrs.override_redirect = True;
+    attrs.background_pixel = WhitePixel(x11.display, DefaultScreen(x11.display));
+    auto outline = XCreateWindow(x11, x11.root, 0, 0, 1, 1, 0, CopyFromParent,
+            InputOutput, CopyFromParent, CWOverrideRedirect | CWBackPixel, &attrs);
+    // Let clicks fall through to whatever is underneath.
+    XShapeCombineRectangles(x11, outline, ShapeInput, 0, 0, 0, 0, ShapeSet, Unsorted);
+    return outline;
+}
 
-int
-catchmain(int argc, char *argv[])
+static void
+showOutline(X11Env &x11, Window outline, const Geometry &geom, const long *frame)
+{
+    constexpr int THICKNESS = 3;
+    short width = geom.size.width + frame[0] + frame[1];
+    short height = geom.size.height + frame[2] + frame[3];
+    XRectangle edges[] = {
+        { 0, 0, (unsigned short)width, THICKNESS },
+        { 0, short(height - THICKNESS), (unsigned short)width, THICKNESS },
+        { 0, 0, THICKNESS, (unsigned short)height },
+        { short(width - THICKNESS), 0, THICKNESS, (unsigned short)height },
+    };
+    XMoveResizeWindow(x11, outline, geom.x - frame[0], geom.y - frame[2], width, height);
+    XShapeCombineRectangles(x11, outline, ShapeBounding, 0, 0, edges, 4, ShapeSet, Unsorted);
+    XMapRaised(x11, outline);
+    XFlush(x11);
+}
+
+/*
+ * Interactive mode: keys fling the window around until we get one we don't
+ * know, or go MAXIDLE milliseconds without one. Glides run in the same loop
+ * as the keyboard: all the keys that have arrived are folded into one place
+ * for the window, and a key that arrives mid-glide just sends the window
+ * on somewhere else from wherever it's got to.
+ *
+ * With an outline, the keys move that instead, and the window itself is
+ * only moved once, on Enter or timing out. Any other key leaves it alone.
+ */
+static void
+interact(X11Env &x11, Window win, const Geometry &usable, Geometry &window, const long *frame)
+{
+    auto keyWin = XCreateSimpleWindow(x11, x11.root, 0, 0, 1, 1, 0, 0, 0);
+    if (keyWin == 0)
+       abort();
+
+    XMapWindow(x11, keyWin);
+    XFlush(x11);
+    XSelectInput(x11, keyWin, ExposureMask | KeyPressMask);
+
+    int symsPerKey, minCodes, maxCodes;
+    auto codes = XDisplayKeycodes(x11, &minCodes, &maxCodes);
+    if (!codes)
+       abort();
+    KeySym *keySyms;
+    {
+        RoundTrip wait(x11);
+        keySyms = XGetKeyboardMapping(x11, minCodes, maxCodes - minCodes + 1, &symsPerKey);
+    }
+
+    // Compile the operations once, and index them by keycode, so a keypress is a single lookup.
+    static std::vector<Location> operations;
+    if (operations.empty())
+        for (auto &op : keyOperations)
+            operations.push_back(*Location::compile(op.operation));
+    std::vector<const Location *> keyToOperation(maxCodes + 1);
+    for (int code = minCodes; code <= maxCodes; ++code)
+        for (size_t i = 0; i < operations.size(); ++i)
+            if (keySyms[(code - minCodes) * symsPerKey] == keyOperations[i].sym)
+                keyToOperation[code] = &operations[i];
+    XFree(keySyms);
+
+    Glide motion(x11, moveOptions.glideOptions);
+    bool gliding = false, finished = false;
+    Window outline = moveOptions.outline ? createOutline(x11) : None;
+    bool commit = false, located = false;
+
+    int fd = ConnectionNumber(x11.display);
+    struct pollfd pfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    pfd.fd = fd;
+
+    struct timeval lastKey;
+    gettimeofday(&lastKey, 0);
+    for (bool done = false; !done;) {
+        bool moved = false;
+        while (!done && XPending(x11)) {
+            XEvent event;
+            XNextEvent(x11, &event);
+            x11.handleEvent(event);
+            motion.handleEvent(event);
+            if (event.type != KeyPress)
+                continue;
+            gettimeofday(&lastKey, 0);
+            auto code = event.xkey.keycode;
+            const Location *todo = code < keyToOperation.size() ? keyToOperation[code] : 0;
+            if (todo == 0 || todo->empty()) {
+                commit = todo != 0;
+                done = true;
+                break;
+            }
+            todo->apply(usable, window, &moveOptions.border, frame);
+            moved = located = true;
+        }
+
+        if (moved) {
+            if (outline != None) {
+                showOutline(x11, outline, window, frame);
+            } else if (!moveOptions.glide) {
+                Transaction move(x11);
+                move.geometry(win, window);
+                move.commit();
+            } else if (gliding) {
+                motion.retarget(win, window);
+            } else {
+                motion.add(win, x11.getGeometry(win), window);
+                motion.begin();
+                gliding = true;
+            }
+            finished = false;
+        }
+        // Wait for the window to catch up with its proxy in this loop, not in finish().
+        if (gliding && !finished) {
+            motion.step();
+            if (motion.done() && motion.landed()) {
+                motion.finish();
+                finished = true;
+            }
+        }
+        if (done)
+            break;
+
+        struct timeval now;
+        gettimeofday(&now, 0);
+        long wait = MAXIDLE - msecDiff(now, lastKey);
+        if (gliding && !finished) {
+            timespec next = motion.deadline(), mono;
+            clock_gettime(CLOCK_MONOTONIC, &mono);
+            long untilFrame = (next.tv_sec - mono.tv_sec) * 1000
+                    + (next.tv_nsec - mono.tv_nsec) / 1000000;
+            wait = std::max(0L, std::min(wait, untilFrame));
+        } else if (wait <= 0) {
+            commit = true;
+            break;
+        }
+        if (!XPending(x11))
+            poll(&pfd, 1, wait);
+    }
+    XDestroyWindow(x11, keyWin);
+    // Whatever key ended it, don't leave a glide part-way there.
+    if (gliding && !finished)
+        motion.complete();
+    if (outline != None) {
+        XDestroyWindow(x11, outline);
+        if (commit && located) {
+            if (moveOptions.glide) {
+                motion.add(win, x11.getGeometry(win), window);
+                motion.run();
+            } else {
+                Transaction move(x11);
+                move.geometry(win, window);
+                move.commit();
+            }
+        }
+    }
+    XSync(x11, False);
+}
+
+enum { DURATION = 256, FPS, EASING, PACE, JUMP_LATENCY, NO_SYNC_REQUEST, LAYOUT, OUTLINE, PROXY,
+    CLASS, TITLE, DESKTOP, MONITOR, WORKDIR, SAVE, RESTORE };
+static const option longopts[] = {
+    { "duration", required_argument, 0, DURATION },
+    { "fps", required_argument, 0, FPS },
+    { "easing", required_argument, 0, EASING },
+    { "pace", required_argument, 0, PACE },
+    { "jump-latency", required_argument, 0, JUMP_LATENCY },
+    { "no-sync-request", no_argument, 0, NO_SYNC_REQUEST },
+    { "layout", required_argument, 0, LAYOUT },
+    { "outline", no_argument, 0, OUTLINE },
+    { "proxy", no_argument, 0, PROXY },
+    { "class", required_argument, 0, CLASS },
+    { "title", required_argument, 0, TITLE },
+    { "desktop", required_argument, 0, DESKTOP },
+    { "monitor", required_argument, 0, MONITOR },
+    { "workdir", required_argument, 0, WORKDIR },
+    { "save", required_argument, 0, SAVE },
+    { "restore", required_argument, 0, RESTORE },
+    { 0, 0, 0, 0 }
+};
+static const char shortopts[] = "o:s:t:w:W:abfghimnpuvx_O:YNA";
+
+bool
+waitsForUser(int argc, char *argv[])
+{
+    // getopt shuffles the arguments it's given: let it shuffle a copy.
+    std::vector<char *> args(argv, argv + argc);
+    args.push_back(0);
+    int reporting = opterr, c;
+    opterr = 0;
+    optind = 0;
+    bool waits = false;
+    while ((c = getopt_long(argc, &args[0], shortopts, longopts, 0)) != -1)
+        waits = waits || c == 'i' || c == 'p';
+    opterr = reporting;
+    return waits;
+}
+
+static int
+flingCommand(X11Env &x11, int argc, char *argv[])
 {
     int screen = -1, c;
-    int verbose = 0;
     bool doPick = false;
     bool interactive = false;
     double opacity = -1;
@@ -234,22 +441,75 @@ catchmain(int argc, char *argv[])
     bool windowRelative = false;
     Window win = 0;
     const char *workdir = 0;
+    const char *layout = 0;
+    const char *savePath = 0;
+    const char *restorePath = 0;
     std::set<Atom> toggles;
-
-    Display *display = XOpenDisplay(0);
-    if (display == 0) {
-        std::clog << "failed to open display: set DISPLAY environment variable" << std::endl;
-        return 1;
-    }
-    X11Env x11(display);
+    Selector selector;
 
     if (argc == 1)
         usage(std::cerr);
 
+    // Reset state left over from any previous command in a resident process.
+    nodo = false;
+    moveOptions = MoveOptions();
+    verbose = 0;
+    activeWait = 500;
+    optind = 0;
 
     X11Env::StateUpdateAction action = X11Env::TOGGLE;
-    while ((c = getopt(argc, argv, "o:s:w:W:abfghimnpuvx_O:YNA")) != -1) {
+    while ((c = getopt_long(argc, argv, shortopts, longopts, 0)) != -1) {
         switch (c) {
+            case DURATION:
+                moveOptions.glideOptions.duration = realarg(0, 60000);
+                break;
+            case FPS:
+                moveOptions.glideOptions.fps = realarg(0, 1000);
+                break;
+            case EASING:
+                if (!parseEasing(optarg, &moveOptions.glideOptions.easing))
+                    usage(std::cerr);
+                break;
+            case PACE:
+                moveOptions.glideOptions.inflight = wholearg(0, 1000);
+                break;
+            case JUMP_LATENCY:
+                moveOptions.glideOptions.jumpLatency = wholearg(0, 60000);
+                break;
+            case NO_SYNC_REQUEST:
+                moveOptions.glideOptions.syncRequest = false;
+                break;
+            case PROXY:
+                moveOptions.glideOptions.proxy = true;
+                break;
+            case OUTLINE:
+                moveOptions.outline = interactive = true;
+                break;
+            case LAYOUT:
+                layout = optarg;
+                break;
+            case CLASS:
+                selector.wmClass = optarg;
+                break;
+            case TITLE:
+                selector.title = optarg;
+                break;
+            case DESKTOP:
+                selector.byDesktop = true;
+                selector.desktop = intarg();
+                break;
+            case MONITOR:
+                selector.monitor = intarg();
+                break;
+            case WORKDIR:
+                selector.workdir = optarg;
+                break;
+            case SAVE:
+                savePath = optarg;
+                break;
+            case RESTORE:
+                restorePath = optarg;
+                break;
             case 'N':
                 action = X11Env::REMOVE;
                 break;
@@ -262,6 +522,9 @@ catchmain(int argc, char *argv[])
             case 's':
                 screen = intarg();
                 break;
+            case 't':
+                activeWait = intarg();
+                break;
             case 'n':
                 nodo = true;
                 break;
@@ -302,19 +565,20 @@ catchmain(int argc, char *argv[])
                break;
             case 'x':
                windowRelative = true;
-               border = 0; // assume the window already has adequate space around it.
+               moveOptions.border = 0; // assume the window already has adequate space around it.
                break;
             case 'W':
                workdir = optarg;
                break;
             case 'v':
                verbose++;
+               x11.instrument = true;
                break;
             case 'i':
                interactive = true;
                break;
             case 'g':
-               glide = !glide;
+               moveOptions.glide = !moveOptions.glide;
                break;
             default:
                usage(std::cerr);
@@ -322,9 +586,80 @@ catchmain(int argc, char *argv[])
         }
     }
 
+    // Selectors pick out any number of windows, rather than just one.
+    std::vector<ClientInfo> matches;
+    if (!selector.empty()) {
+        if (interactive || windowRelative || win != 0 || doPick)
+            usage(std::cerr);
+        x11.phase("select");
+        matches = selectWindows(x11, selector);
+        if (matches.empty()) {
+            std::cerr << "no windows match\n";
+            return 0;
+        }
+    }
+
+    // Layout files cover every window, or just those the selectors match.
+    if (savePath != 0 || restorePath != 0) {
+        if (selector.empty()) {
+            x11.phase("select");
+            x11.indexClients(matches);
+        }
+        if (savePath != 0)
+            saveLayout(x11, savePath, matches);
+        if (restorePath != 0) {
+            x11.phase("state");
+            restoreLayout(x11, restorePath, matches);
+        }
+        return 0;
+    }
+
+    /*
+     * Layouts take the windows to place from the selectors, or from the rest
+     * of the command line, each optionally followed by "=" and the control
+     * string for it.
+     */
+    if (layout != 0) {
+        std::vector<Placement> placements;
+        if (!selector.empty()) {
+            if (optind != argc)
+                usage(std::cerr);
+            for (size_t i = 0; i < matches.size(); ++i) {
+                Placement p;
+                p.win = matches[i].win;
+                if (!layoutLocation(layout, i, matches.size(), &p.location))
+                    usage(std::cerr);
+                placements.push_back(p);
+            }
+        }
+        size_t count = argc - optind;
+        for (size_t i = 0; i < count; ++i) {
+            char *arg = argv[optind + i];
+            char *end;
+            Placement p;
+            p.win = strtoul(arg, &end, 0);
+            if (end == arg || (*end != 0 && *end != '='))
+                usage(std::cerr);
+            if (*end == '=')
+                p.location = end + 1;
+            else if (!layoutLocation(layout, i, count, &p.location))
+                usage(std::cerr);
+            placements.push_back(p);
+        }
+        placeWindows(x11, placements, screen, moveOptions);
+        return 0;
+    }
+
+    if (!selector.empty()) {
+        updateWindows(x11, matches, toggles, action, opacity, opacityDelta, workdir,
+              optind < argc ? argv[optind] : 0, screen);
+        return 0;
+    }
+
     // Which window are we modifying?
+    x11.phase(win != 0 || doPick ? "select" : "active");
     if (win == 0)
-       win = doPick ? x11.pick() : x11.active();
+       win = doPick ? x11.pick() : x11.active(requester, activeWait);
     if (win == 0) {
         std::cerr << "no window selected\n";
         return 0;
@@ -332,168 +667,124 @@ catchmain(int argc, char *argv[])
 
     std::clog << "updating " << win << "\n";
 
-    // If we're doing state toggles/misc changes to window, do it now.
+    /*
+     * State toggles/misc changes to the window are queued now, and go out
+     * with the state changes a move makes, all at once.
+     */
+    x11.phase("toggles");
+    Transaction changes(x11);
     if (opacity >= 0.0)
-        setOpacity(x11, win, opacity);
+        setOpacity(x11, changes, win, opacity);
     if (opacityDelta != 0.0)
-        setOpacityDelta(x11, win, opacityDelta);
+        setOpacityDelta(x11, changes, win, opacityDelta);
     if (workdir != 0)
-        setWorkdir(x11, win, workdir);
+        setWorkdir(x11, changes, win, workdir);
     for (auto atom : toggles)
-        x11.updateState(win, atom, action);
+        changes.state(win, atom, action, maximizedWith(x11, atom));
 
     // If nothing else to do, just exit.
-    if (argc == optind && !interactive)
+    if (argc == optind && !interactive) {
+        changes.commit();
         return 0;
-
-    if (screen == -1)
-        screen = x11.monitorForWindow(win);
+    }
 
     /*
      * get the extent of the frame around the window: we assume the new frame
      * will have the same extents when we resize it, and use that to adjust the
      * position of the client window so its frame abuts the edge of the screen.
+     * Its desktop and geometry come in the same batch (or from a publisher,
+     * if there is one): we ignore windows on other desktops for struts
+     * avoidance, etc.
      */
-    Atom actualType;
-    int actualFormat;
-    unsigned long itemCount;
-    unsigned long afterBytes;
-    unsigned char *prop;
-    long desktop;
-    int rc;
-    const long *frame;
-    frame = 0;
-    rc = XGetWindowProperty(x11, win, x11.NetFrameExtents,
-            0, std::numeric_limits<long>::max(), False, x11.Cardinal,
-            &actualType, &actualFormat, &itemCount, &afterBytes, &prop);
-    bool haveFrame = rc == 0 && actualFormat == 32 && itemCount == 4;
-    if (!haveFrame) {
-        std::cerr << "can't find frame sizes: rc = " << rc << ", actualFormat="
-            << actualFormat << ", itemCount=" << itemCount << std::endl;
-        static long defaultFrame[] = { 0, 0, 0, 0 };
-        if (frame)
-            XFree((void *)frame);
-        frame = defaultFrame;
-    } else {
-        frame = (long *)prop;
+    x11.phase("frame");
+    std::vector<WindowInfo> infos;
+    x11.describeWindows({ win }, infos);
+    const WindowInfo &info = infos[0];
+    if (!info.exists) {
+        std::cerr << "window " << win << " has gone\n";
+        return 1; // and so have the changes we'd have made to it.
     }
+    const long *frame = info.frame;
+    if (screen == -1)
+        screen = x11.monitorAt(info.geom);
+    x11.phase("struts");
+    Geometry usable = x11.usableArea(info.desktop, screen);
 
-    // Work out starting geometry - either existing size, or entire window
+    // Work out starting geometry - either existing size, or all the space on the monitor
     Geometry window;
     if (windowRelative) {
-       window = x11.getGeometry(win);
-       if (rc == 0)
-           XFree(prop);
+       window = info.geom;
     } else {
-       window = x11.monitors[screen];
+       window = usable;
     }
+    // Remove any toggles that make the window size moot, unless we know it has none.
+    x11.phase("state");
+    for (auto atom : { x11.NetWmStateShaded, x11.NetWmStateMaximizedHoriz, x11.NetWmStateFullscreen })
+        if (!toggles.empty() || x11.mayHaveState(win, atom))
+            changes.state(win, atom, X11Env::REMOVE, maximizedWith(x11, atom));
 
-    /*
-     * Find desktop of the window in question - we ignore windows on other
-     * desktops for struts avoidance, etc.
-     */
-    desktop = x11.desktopForWindow(win);
-    // Remove any toggles that make the window size moot.
-    x11.updateState(win, x11.NetWmStateShaded, X11Env::REMOVE);
-    x11.updateState(win, x11.NetWmStateMaximizedHoriz, X11Env::REMOVE);
-    x11.updateState(win, x11.NetWmStateFullscreen, X11Env::REMOVE);
-
+    x11.phase("glide");
     if (interactive) {
-        auto keyWin = XCreateSimpleWindow(x11, x11.root, 0, 0, 1, 1, 0, 0, 0);
-        if (keyWin == 0)
-           abort();
-
-        XMapWindow(x11, keyWin);
-        XFlush(x11);
-        XSelectInput(x11, keyWin, ExposureMask | KeyPressMask);
-
-        int symsPerKey, minCodes, maxCodes;
-        auto codes = XDisplayKeycodes(x11, &minCodes, &maxCodes);
-        if (!codes)
-           abort();
-        auto keySyms = XGetKeyboardMapping(x11, minCodes, maxCodes - minCodes, &symsPerKey);
-
-        static std::map<int, const char *> keyToOperation = {
-
-           { XK_Up, "u" },
-           { XK_Down, "d" },
-           { XK_Left, "l" },
-           { XK_Right, "r" },
-
-           { XK_KP_8, "u" },
-           { XK_KP_2, "d" },
-           { XK_KP_4, "l" },
-           { XK_KP_6, "r" },
-
-           { XK_KP_7, "ul" },
-           { XK_KP_9, "ur" },
-           { XK_KP_1, "dl" },
-           { XK_KP_3, "dr" },
-
-           { XK_KP_Up, "u" },
-           { XK_KP_Down, "d" },
-           { XK_KP_Left, "l" },
-           { XK_KP_Right, "r" },
-
-           { XK_KP_Home, "ul" },
-           { XK_KP_Page_Up, "ur" },
-           { XK_KP_End, "dl" },
-           { XK_KP_Page_Down, "dr" }
-        };
-
-
-        int fd = ConnectionNumber(x11.display);
-        struct pollfd pfd;
-        pfd.events = POLLIN;
-        pfd.revents = 0;
-        pfd.fd = fd;
- 
-        struct timeval lastKey;
-        gettimeofday(&lastKey, 0);
-        for (bool done = false; !done;) {
-           struct timeval now;
-            gettimeofday(&now, 0);
-            long wait = MAXIDLE - msecDiff(now, lastKey);
-            poll(&pfd, 1, wait);
-            gettimeofday(&now, 0);
-            if (msecDiff(now, lastKey) > MAXIDLE)
-               exit(0);
-            XEvent event;
-            XNextEvent(x11, &event);
-            switch (event.type) {
-            case KeyPress:
-                gettimeofday(&lastKey, 0);
-                auto i = (event.xkey.keycode - minCodes) * symsPerKey;
-                auto todo = keyToOperation.find(keySyms[i]);
-                if (todo == keyToOperation.end())
-                    exit(0);
-                resizeWindow(x11, desktop, window, win, &border, frame, todo->second);
-                break;
-            }
-        }
+        changes.commit();
+        interact(x11, win, usable, window, frame);
     } else {
-        static std::map<std::string, const char *> aliases = {
-            { "top",        "u" },
-            { "bottom",     "d" },
-            { "left",       "l" },
-            { "right",      "r" },
-            { "topleft",    "ul" },
-            { "topright",   "ur" },
-            { "bottomleft", "dl" },
-            { "bottomright", "dr" },
-        };
+        // Aliases like "topleft" are resolved when the location is compiled.
         const char *location = argv[optind];
-        auto alias = aliases.find(location);
-        if (alias != aliases.end())
-            location = alias->second;
-        resizeWindow(x11, desktop, window, win, &border, frame, location);
+        if (!windowRelative)
+            rememberPlacement(x11, win, screen, location);
+        resizeWindow(x11, changes, usable, window, win, info.geom, &moveOptions.border, frame, location);
     }
-    if (haveFrame)
-       XFree((unsigned char *)frame);
-    XCloseDisplay(display);
     return 0;
 }
 
+int
+runCommand(X11Env &x11, int argc, char *argv[])
+{
+    int rc = flingCommand(x11, argc, argv);
+    // We may have moved the active window, without seeing every event that says so.
+    x11.prefetchStale = true;
+    x11.endPhase();
+    if (x11.stats == "json")
+        x11.reportPhases(std::clog, true);
+    else if (verbose || !x11.stats.empty())
+        x11.reportPhases(std::clog, false);
+    x11.writeTrace();
+    return rc;
+}
+
+int
+catchmain(int argc, char *argv[])
+{
+    bool daemon = argc == 2 && strcmp(argv[1], "--daemon") == 0;
+    bool publish = argc == 2 && strcmp(argv[1], "--publish") == 0;
+    requester = getpid();
+
+    // A controller opens the displays it's given itself.
+    if (argc >= 2 && strcmp(argv[1], "--controller") == 0)
+        return controllerMain(argc - 2, argv + 2);
+
+    // Let a resident daemon do the work if there is one.
+    if (!daemon && !publish) {
+        int rc = clientMain(argc, argv);
+        if (rc != -1)
+            return rc;
+    }
+
+    long opening = nsecNow();
+    Display *display = XOpenDisplay(0);
+    long opened = nsecNow();
+    if (display == 0) {
+        std::clog << "failed to open display: set DISPLAY environment variable" << std::endl;
+        return 1;
+    }
+    // One-shot commands use what a publisher has found out, if there's one running.
+    X11Env x11(display, !daemon && !publish);
+    x11.trace("XOpenDisplay", opening, opened);
+    int rc = daemon ? daemonMain(x11) : publish ? publishMain(x11) : runCommand(x11, argc, argv);
+    XCloseDisplay(display);
+    return rc;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -0,0 +1,331 @@
+#pragma once
+#include "wmhack.h"
+#include <string>
+#include <deque>
+#include <memory>
+#include <X11/extensions/sync.h>
+#include <X11/extensions/Xrender.h>
+#include <time.h>
+
+/*
+ * Interfaces shared between the one-shot fling command, the resident daemon,
+ * and the thin client that forwards a command line to the daemon.
+ */
+
+// Run one fling command line against an already-initialised environment.
+int runCommand(X11Env &x11, int argc, char *argv[]);
+
+// Set when running inside a long-lived process: usage errors must not exit.
+extern bool resident;
+
+// The process whose command we are running, for active window detection.
+extern pid_t requester;
+
+// Where the daemon for a display (by default, $DISPLAY) listens.
+std::string socketPath(const char *display = 0);
+
+// Serve commands on socketPath() until killed.
+int daemonMain(X11Env &x11);
+
+// Keep a Publisher up to date until killed.
+int publishMain(X11Env &x11);
+
+// Serve commands for each of "displays", on each one's socketPath(), until killed.
+int controllerMain(int count, char *displays[]);
+
+// Run a command line for a hotkey in a resident fling.
+void runResident(X11Env &x11, int argc, char *argv[]);
+
+// Will this command line wait on the user, for a click or keys, before it's done?
+bool waitsForUser(int argc, char *argv[]);
+
+/*
+ * A publisher keeps what one-shot flings need to know about the display in
+ * shared memory (see shared.h), so they can skip asking the server for it.
+ * Changes it hears about mark it out of date straight away, and it publishes
+ * again once they've settled.
+ */
+class Publisher {
+    X11Env &x11;
+    std::string name; // of the shared memory.
+    SharedState *state;
+    unsigned long monitorChanges;
+    long due; // when to publish (nsecNow()), or 0 if we're up to date.
+public:
+    Publisher(X11Env &x11);
+    ~Publisher();
+    void handleEvent(const XEvent &); // after x11.handleEvent().
+    int timeout() const; // milliseconds until publish() is due, or -1.
+    void publish();
+};
+
+/*
+ * A resident fling remembers where it last put each window, so it can put
+ * them back in their places when monitors come and go. Does nothing when
+ * we're not resident.
+ */
+void rememberPlacement(X11Env &x11, Window win, int screen, const std::string &location);
+
+/*
+ * A resident fling can grab key chords itself, and run the fling command line
+ * bound to each in-process, rather than have the WM run fling for every
+ * press. Bindings come from bindingsPath(), and are reloaded when it changes.
+ */
+std::string bindingsPath();
+
+/*
+ * Tells us when a file changes. The watch is on its directory, so we see
+ * editors that replace the file too. Until the directory exists, we watch
+ * the nearest ancestor that does, and move down as the rest appear.
+ */
+class FileWatch {
+    std::string path;
+    std::string watched; // the directory we watch...
+    std::string entry; // ... for this name in it: the file, or the next directory down.
+    int inotify; // -1 if we can't watch at all.
+    int wd;
+    void arm();
+public:
+    FileWatch(const std::string &path);
+    ~FileWatch();
+    int fd() const { return inotify; }
+    bool changed(); // fd() is readable: has the file changed?
+};
+
+class Hotkeys {
+    struct Binding {
+        unsigned modifiers;
+        KeyCode code;
+        std::vector<std::string> args; // the command line, including argv[0]
+    };
+    X11Env &x11;
+    std::string path;
+    std::unique_ptr<FileWatch> watch; // unless someone else is watching for us.
+    unsigned ignoredModifiers; // CapsLock and NumLock
+    std::vector<Binding> bindings;
+    void grab(bool on);
+public:
+    Hotkeys(X11Env &x11, bool watching = true); // watch the bindings file for changes?
+    ~Hotkeys();
+    int fd() const { return watch ? watch->fd() : -1; }
+    void load(); // (re)read the bindings, and grab their keys.
+    bool changed(); // fd() is readable: reload if the bindings file changed, and say if it did.
+    bool handleEvent(const XEvent &); // run the command for a grabbed key.
+};
+
+/*
+ * Forward the command line to a running daemon. Returns the command's exit
+ * status, or -1 if no daemon is listening, in which case the caller should do
+ * the work itself.
+ */
+int clientMain(int argc, char *argv[]);
+
+/*
+ * Glides: animating windows from where they are to where they're going.
+ */
+enum class Easing { LINEAR, EASE_OUT, DAMPED };
+
+struct GlideOptions {
+    int duration = 150; // milliseconds
+    double fps = 0; // frames per second: 0 matches the display's refresh rate.
+    Easing easing = Easing::LINEAR;
+    /*
+     * Most frames a window can have waiting for the WM to act on them, or 0
+     * not to wait for the WM at all. When a window has this many outstanding,
+     * its frames are skipped until the WM catches up.
+     */
+    unsigned inflight = 0;
+    int jumpLatency = 50; // milliseconds: WMs slower than this just get the last frame.
+    /*
+     * For clients that support _NET_WM_SYNC_REQUEST, send each frame that
+     * resizes the window only once the client has repainted for the last.
+     */
+    bool syncRequest = true;
+    /*
+     * Glide a scaled snapshot of each window, using Composite and RENDER,
+     * and resize the window itself only once, at the end.
+     */
+    bool proxy = false;
+};
+
+// Parse an easing name, returning false if it isn't one.
+bool parseEasing(const char *name, Easing *easing);
+
+/*
+ * Frames are due at fixed deadlines from the start of the glide. If we fall
+ * behind, we skip to the frame that's due rather than stretching the glide.
+ */
+class Glide {
+    struct Frame {
+        Geometry geom;
+        timespec sent;
+    };
+    struct Track {
+        Window win;
+        Geometry from;
+        Geometry to;
+        int shown; // last frame sent for this window.
+        std::deque<Frame> inflight; // sent, but not yet seen in a ConfigureNotify.
+        XSyncCounter counter; // _NET_WM_SYNC_REQUEST_COUNTER, if the client has one.
+        XSyncAlarm alarm; // tells us when the client has repainted.
+        int64_t syncValue; // the counter value we're waiting for the client to reach...
+        int64_t counterValue; // ... and the last we saw it at.
+        bool repainting; // waiting for the client to reach syncValue.
+        timespec syncSent;
+        Window proxy; // stands in for the window while it glides, if we have one.
+        Pixmap pixmap; // the window's contents...
+        Picture source; // ... as a picture we can scale...
+        Picture dest; // ... onto the proxy.
+        Size snapshot; // the size of the window's contents.
+        long opacity; // _NET_WM_WINDOW_OPACITY before we hid the window, or -1 if it had none.
+    };
+    // When each frame went out, against when it was due, for tracing.
+    struct Sent {
+        int frame;
+        long due;
+        long sent;
+    };
+    X11Env &x11;
+    GlideOptions options;
+    std::vector<Track> tracks;
+    std::vector<Sent> sends;
+    bool wmSyncs; // the WM does _NET_WM_SYNC_REQUEST itself: we only watch.
+    bool proxies; // the server can do proxies.
+    timespec start;
+    long period; // nanoseconds between frames
+    int frames; // frames in the whole glide.
+    int reached; // the frame the clock has reached.
+    Geometry at(const Track &, int frame) const;
+    void acknowledge(Track &, const XConfigureEvent &);
+    void expire(Track &, const timespec &now);
+    void findSyncCounters();
+    void syncRequest(Track &, const timespec &now);
+    void makeProxies();
+    bool makeProxy(Track &);
+    void drawProxy(Track &, const Geometry &);
+    void dropProxy(Track &);
+    bool waitsForEvents() const;
+    void reportFrames();
+public:
+    Glide(X11Env &x11, const GlideOptions &options);
+    ~Glide();
+    void add(Window win, const Geometry &from, const Geometry &to);
+    void begin(); // start the clock.
+    // Send a window somewhere else, starting again from wherever it's got to.
+    void retarget(Window win, const Geometry &to);
+    bool done() const;
+    bool landed(); // once done, have the windows caught up with their proxies, or given up?
+    timespec deadline() const; // when the next frame is due.
+    void step(); // send the frame due now, if we haven't already.
+    void handleEvent(const XEvent &); // hear from the WM about frames we sent.
+    void pump(); // handle any ConfigureNotify events that have arrived.
+    void run(); // send all the frames, sleeping between them.
+    void complete(); // as run(), for a glide already under way.
+    void finish(); // once done, take down the proxies when the WM has caught up, waiting if need be.
+};
+
+// How windows get to where they're going.
+struct MoveOptions {
+    unsigned border = 2; // pixels to leave around the window's frame.
+    bool glide = true;
+    bool outline = false; // interactive mode moves an outline, not the window.
+    GlideOptions glideOptions;
+};
+
+/*
+ * A control string like "2/3dl", compiled: parsed once into the steps it
+ * takes, so applying it again is only the arithmetic. Aliases like "topleft"
+ * compile to the strings they stand for.
+ */
+class Location {
+    bool parse(const char *location);
+public:
+    struct Step {
+        char op; // one of "lrudhv"
+        double num;
+        double denom;
+        double fraction; // num / denom
+    };
+    std::vector<Step> steps;
+    long border = -1; // from a 'b', or -1 to leave the border as it is.
+    bool empty() const { return steps.empty() && border == -1; }
+    /*
+     * Compile "location", or find it already compiled. Returns 0 if it's not
+     * a valid control string.
+     */
+    static std::shared_ptr<const Location> compile(const char *location);
+    /*
+     * Apply to "geom", which starts out as the space to divide up. The result
+     * is clipped to "usable", and made room in for the window's frame and
+     * our border.
+     */
+    void apply(const Geometry &usable, Geometry &geom, unsigned *border, const long *frame) const;
+};
+
+/*
+ * Compile and apply a control string in one go. Returns false if the control
+ * string is bad.
+ */
+bool locate(const Geometry &usable, Geometry &geom, unsigned *border,
+      const long *frame, const char *location);
+
+/*
+ * Select windows by their properties, rather than one at a time. A window
+ * must match every criterion given.
+ */
+struct Selector {
+    const char *wmClass = 0; // either part of WM_CLASS, ignoring case.
+    const char *title = 0; // an extended regular expression found in the title.
+    bool byDesktop = false;
+    long desktop = 0;
+    int monitor = -1;
+    const char *workdir = 0; // _PME_WORKDIR, as set by -W.
+    bool empty() const; // matches every window: no criteria at all.
+};
+
+// The clients that match, found with a single sweep over the client list.
+std::vector<ClientInfo> selectWindows(X11Env &x11, const Selector &);
+
+/*
+ * Layout files: where every window is, and how, saved to be put back
+ * later, all in one go. See snapshot.cc.
+ */
+void saveLayout(X11Env &x11, const char *path, const std::vector<ClientInfo> &clients);
+// Returns how many of "clients" were in the file, and so put back.
+size_t restoreLayout(X11Env &x11, const char *path, const std::vector<ClientInfo> &clients);
+
+/*
+ * Layouts place several windows at once.
+ */
+struct Placement {
+    Window win;
+    std::string location; // control string for this window.
+    int screen = -1; // monitor to place it on, or -1 for the one placeWindows is given.
+};
+
+// The control string for the index'th of "count" windows in a named layout.
+bool layoutLocation(const std::string &layout, size_t index, size_t count, std::string *location);
+
+// Where a placement will put its window.
+struct Planned {
+    size_t index; // of the placement.
+    Window win;
+    int screen;
+    Geometry from;
+    Geometry to;
+};
+
+/*
+ * Work out where placeWindows would put each window, without moving any.
+ * Windows that have gone away are left out.
+ */
+std::vector<Planned> planPlacements(DisplayBackend &display,
+      const std::vector<Placement> &placements, int screen, unsigned border);
+
+/*
+ * Move all the windows to their places on monitor "screen" (or the monitor
+ * of the first window, if -1), gliding them together. A placement with its
+ * own screen goes there instead.
+ */
+void placeWindows(X11Env &x11, const std::vector<Placement> &placements, int screen,
+      const MoveOptions &options);
@@ -0,0 +1,254 @@
+/*
+ * Time fling commands end to end, from fork to exit, against whatever WM is
+ * running: normally benchwm on Xvfb (see bench.sh). Each scenario is run a
+ * number of times, and we report the median and 99th percentile, along with
+ * the mean, least and most round trips fling says it made (from -v). A
+ * scenario can also check where the window ends up, and we fail if it's wrong.
+ */
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/XTest.h>
+#include <algorithm>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+struct Scenario {
+    const char *name;
+    std::vector<const char *> setup; // run, untimed, before each iteration.
+    std::vector<std::vector<const char *>> runs; // taken in turn, so windows keep moving.
+    std::vector<const char *> keys; // keysyms to type at interactive mode.
+    std::vector<const char *> expect; // run untimed after: must leave the window where it is.
+    bool active; // leave fling to find the active window, rather than passing -w.
+};
+
+static const Scenario scenarios[] = {
+    { "toggle", {}, { { "-a" } }, {}, {}, false },
+    { "fling", {}, { { "-g", "ul" }, { "-g", "dr" } }, {}, {}, false },
+    // As fling is mostly run: on whatever has the focus.
+    { "active", {}, { { "-g", "ul" }, { "-g", "dr" } }, {}, {}, true },
+    { "relative", { "-g", "ul" }, { { "-x", "-g", "r" } }, {}, {}, false },
+    { "interactive", {}, { { "-g", "-i" } }, { "Up", "Left", "Right", "KP_Home", "Escape" }, {}, false },
+    { "glide", {}, { { "ul" }, { "dr" } }, {}, {}, false },
+    // Enter arrives while the window is still gliding: it must still get there.
+    { "interrupted", { "-g", "d" }, { { "-i" } }, { "Up", "Return" }, { "-g", "u" }, false },
+    // Puts back every client: the round trips shouldn't grow with their number.
+    { "restore", { "--save", "flingbench.layout" }, { { "--restore", "flingbench.layout" } }, {}, {}, false },
+};
+
+static Display *display;
+static const char *fling = "./fling";
+static Window targetWin;
+static std::string target; // the window we fling, as a string for -w.
+
+static double
+msecNow()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Wait for interactive mode's window to get the focus, then type at it.
+static void
+typeKeys(const std::vector<const char *> &keys, Window before)
+{
+    double deadline = msecNow() + 2000;
+    for (;;) {
+        Window focus;
+        int revert;
+        XGetInputFocus(display, &focus, &revert);
+        if (focus != before && focus != None && focus != PointerRoot)
+            break;
+        if (msecNow() > deadline) {
+            std::clog << "interactive window never got the focus" << std::endl;
+            return;
+        }
+        usleep(1000);
+    }
+    for (auto key : keys) {
+        KeyCode code = XKeysymToKeycode(display, XStringToKeysym(key));
+        XTestFakeKeyEvent(display, code, True, CurrentTime);
+        XTestFakeKeyEvent(display, code, False, CurrentTime);
+    }
+    XFlush(display);
+}
+
+// Where the target window is, relative to the root.
+static void
+targetGeometry(int *x, int *y, unsigned *width, unsigned *height)
+{
+    Window root, child;
+    unsigned border, depth;
+    XGetGeometry(display, targetWin, &root, x, y, width, height, &border, &depth);
+    XTranslateCoordinates(display, targetWin, root, 0, 0, x, y, &child);
+}
+
+/*
+ * Run fling with "args", returning how long it took in milliseconds, and
+ * setting "roundTrips" from what it reported. Unless "active", it's told
+ * which window to fling.
+ */
+static double
+run(const std::vector<const char *> &args, const std::vector<const char *> &keys,
+        bool active, unsigned long *roundTrips)
+{
+    std::vector<char *> argv;
+    argv.push_back(const_cast<char *>(fling));
+    argv.push_back(const_cast<char *>("-v"));
+    if (!active) {
+        argv.push_back(const_cast<char *>("-w"));
+        argv.push_back(const_cast<char *>(target.c_str()));
+    }
+    for (auto arg : args)
+        argv.push_back(const_cast<char *>(arg));
+    argv.push_back(0);
+
+    Window focus;
+    int revert;
+    XGetInputFocus(display, &focus, &revert);
+
+    int fds[2];
+    if (pipe(fds) == -1)
+        abort();
+    double start = msecNow();
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], 2);
+        close(fds[0]);
+        close(fds[1]);
+        // Always measure fling itself, not a request to a daemon.
+        setenv("FLING_SOCKET", "", 1);
+        execv(fling, &argv[0]);
+        _exit(127);
+    }
+    close(fds[1]);
+    if (!keys.empty())
+        typeKeys(keys, focus);
+
+    std::string output;
+    char buf[1024];
+    ssize_t rc;
+    while ((rc = read(fds[0], buf, sizeof buf)) > 0)
+        output.append(buf, rc);
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    double elapsed = msecNow() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        std::clog << fling << " failed: " << output;
+
+    static const char marker[] = "round trips: ";
+    auto pos = output.rfind(marker);
+    *roundTrips = pos == std::string::npos ? 0 : strtoul(output.c_str() + pos + strlen(marker), 0, 10);
+    return elapsed;
+}
+
+static void
+usage()
+{
+    std::clog << "usage: flingbench [ -f fling ] [ -n iterations ] [ -l label ] [ scenario ... ]" << std::endl;
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int iterations = 50, c;
+    bool failed = false;
+    const char *label = "";
+    while ((c = getopt(argc, argv, "f:n:l:")) != -1) {
+        switch (c) {
+            case 'f':
+                fling = optarg;
+                break;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    display = XOpenDisplay(0);
+    if (display == 0) {
+        std::clog << "failed to open display" << std::endl;
+        return 1;
+    }
+    if (iterations < 1)
+        usage();
+    int eventBase, errorBase, major, minor;
+    bool xtest = XTestQueryExtension(display, &eventBase, &errorBase, &major, &minor);
+    if (!xtest)
+        std::clog << "no XTEST: skipping interactive mode" << std::endl;
+
+    // Fling the window the WM has made active.
+    Atom activeAtom = XInternAtom(display, "_NET_ACTIVE_WINDOW", False);
+    Atom type;
+    int format;
+    unsigned long count, after;
+    unsigned char *prop;
+    if (XGetWindowProperty(display, DefaultRootWindow(display), activeAtom, 0, 1, False,
+            XA_WINDOW, &type, &format, &count, &after, &prop) != Success || count != 1) {
+        std::clog << "no active window" << std::endl;
+        return 1;
+    }
+    targetWin = *(Window *)prop;
+    target = std::to_string(targetWin);
+    XFree(prop);
+
+    printf("%-12s %8s %10s %10s %12s %6s %6s\n", "scenario", "label", "p50 ms", "p99 ms",
+            "mean trips", "min", "max");
+    for (auto &scenario : scenarios) {
+        if (optind < argc && std::find(argv + optind, argv + argc,
+                std::string(scenario.name)) == argv + argc)
+            continue;
+        if (!scenario.keys.empty() && !xtest)
+            continue;
+        std::vector<double> times;
+        std::vector<unsigned long> roundTrips;
+        for (int i = 0; i < iterations; ++i) {
+            unsigned long trips;
+            if (!scenario.setup.empty())
+                run(scenario.setup, {}, false, &trips);
+            times.push_back(run(scenario.runs[i % scenario.runs.size()], scenario.keys,
+                        scenario.active, &trips));
+            roundTrips.push_back(trips);
+            if (scenario.expect.empty())
+                continue;
+            int x, y, expectX, expectY;
+            unsigned width, height, expectWidth, expectHeight;
+            targetGeometry(&x, &y, &width, &height);
+            run(scenario.expect, {}, false, &trips);
+            targetGeometry(&expectX, &expectY, &expectWidth, &expectHeight);
+            if (x != expectX || y != expectY || width != expectWidth || height != expectHeight) {
+                std::clog << scenario.name << ": window left at " << width << "x" << height
+                    << "+" << x << "+" << y << ", not " << expectWidth << "x" << expectHeight
+                    << "+" << expectX << "+" << expectY << std::endl;
+                failed = true;
+            }
+        }
+        std::sort(times.begin(), times.end());
+        double p50 = times[times.size() / 2];
+        double p99 = times[std::min(times.size() - 1, times.size() * 99 / 100)];
+        // Runs can differ in the round trips they take: show the spread, not just the last.
+        double mean = 0;
+        for (auto trips : roundTrips)
+            mean += trips;
+        mean /= roundTrips.size();
+        auto range = std::minmax_element(roundTrips.begin(), roundTrips.end());
+        printf("%-12s %8s %10.2f %10.2f %12.1f %6lu %6lu\n", scenario.name, label, p50, p99,
+                mean, *range.first, *range.second);
+        fflush(stdout);
+    }
+    XCloseDisplay(display);
+    return failed ? 1 : 0;
+}
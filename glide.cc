@@ -0,0 +1,660 @@
+#include "fling.h"
+#include <cmath>
+#include <errno.h>
+#include <algorithm>
+#include <poll.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/Xcomposite.h>
+
+static const struct {
+    const char *name;
+    Easing easing;
+} easings[] = {
+    { "linear",   Easing::LINEAR },
+    { "ease-out", Easing::EASE_OUT },
+    { "damped",   Easing::DAMPED },
+};
+
+bool
+parseEasing(const char *name, Easing *easing)
+{
+    for (auto &e : easings) {
+        if (strcmp(e.name, name) == 0) {
+            *easing = e.easing;
+            return true;
+        }
+    }
+    return false;
+}
+
+// How far along its path a window is, "t" of the way through the glide.
+static double
+ease(Easing easing, double t)
+{
+    switch (easing) {
+        case Easing::EASE_OUT:
+            return 1 - pow(1 - t, 3);
+        case Easing::DAMPED: {
+            // A critically damped spring, scaled so it arrives at t = 1.
+            constexpr double w = 8;
+            auto spring = [](double t) { return 1 - (1 + w * t) * exp(-w * t); };
+            return spring(t) / spring(1);
+        }
+        case Easing::LINEAR:
+        default:
+            return t;
+    }
+}
+
+static long
+nsecDiff(const timespec &l, const timespec &r)
+{
+    return (l.tv_sec - r.tv_sec) * 1000000000L + l.tv_nsec - r.tv_nsec;
+}
+
+static timespec
+nsecAdd(timespec ts, long nsec)
+{
+    ts.tv_sec += nsec / 1000000000L;
+    ts.tv_nsec += nsec % 1000000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_nsec -= 1000000000L;
+        ts.tv_sec++;
+    }
+    return ts;
+}
+
+Glide::Glide(X11Env &x11_, const GlideOptions &options_)
+    : x11(x11_)
+    , options(options_)
+    , wmSyncs(false)
+    , proxies(false)
+    , period(0)
+    , frames(0)
+    , reached(0)
+{
+    start.tv_sec = start.tv_nsec = 0;
+}
+
+void
+Glide::add(Window win, const Geometry &from, const Geometry &to)
+{
+    Track track;
+    track.win = win;
+    track.from = from;
+    track.to = to;
+    track.shown = 0;
+    track.counter = None;
+    track.alarm = None;
+    track.syncValue = 0;
+    track.counterValue = 0;
+    track.repainting = false;
+    track.proxy = None;
+    track.pixmap = None;
+    track.source = None;
+    track.dest = None;
+    track.opacity = -1;
+    tracks.push_back(track);
+}
+
+Glide::~Glide()
+{
+    for (auto &track : tracks) {
+        if (track.alarm != None)
+            XSyncDestroyAlarm(x11, track.alarm);
+        dropProxy(track);
+    }
+}
+
+/*
+ * Proxies are override-redirect windows we draw a scaled copy of each
+ * window's contents into, so the glide costs the client nothing until the
+ * one real resize at the end.
+ */
+void
+Glide::makeProxies()
+{
+    int eventBase, errorBase, major = 0, minor = 2;
+    RoundTrip wait(x11, 3);
+    if (!XCompositeQueryExtension(x11, &eventBase, &errorBase)
+            || !XCompositeQueryVersion(x11, &major, &minor)
+            || (major == 0 && minor < 2)
+            || !XRenderQueryExtension(x11, &eventBase, &errorBase)) {
+        std::clog << "no Composite or RENDER extension, gliding the windows themselves" << std::endl;
+        return;
+    }
+    proxies = true;
+    for (auto &track : tracks)
+        makeProxy(track);
+}
+
+bool
+Glide::makeProxy(Track &track)
+{
+    XWindowAttributes attrs;
+    RoundTrip wait(x11);
+    if (!XGetWindowAttributes(x11, track.win, &attrs) || attrs.map_state != IsViewable)
+        return false;
+    XRenderPictFormat *format = XRenderFindVisualFormat(x11, attrs.visual);
+    XRenderPictFormat *destFormat = XRenderFindVisualFormat(x11,
+            DefaultVisual(x11.display, DefaultScreen(x11.display)));
+    if (format == 0 || destFormat == 0)
+        return false;
+
+    // Make sure the server keeps the window's contents in a pixmap we can name.
+    XCompositeRedirectWindow(x11, track.win, CompositeRedirectAutomatic);
+    track.pixmap = XCompositeNameWindowPixmap(x11, track.win);
+    XRenderPictureAttributes pa;
+    pa.subwindow_mode = IncludeInferiors;
+    track.source = XRenderCreatePicture(x11, track.pixmap, format, CPSubwindowMode, &pa);
+    XRenderSetPictureFilter(x11, track.source, FilterBilinear, 0, 0);
+    track.snapshot.width = attrs.width;
+    track.snapshot.height = attrs.height;
+
+    XSetWindowAttributes swa;
+    swa.override_redirect = True;
+    swa.background_pixmap = None;
+    const Geometry &g = track.from;
+    track.proxy = XCreateWindow(x11, x11.root, g.x, g.y,
+            std::max(1U, g.size.width), std::max(1U, g.size.height), 0,
+            CopyFromParent, InputOutput, CopyFromParent, CWOverrideRedirect | CWBackPixmap, &swa);
+    track.dest = XRenderCreatePicture(x11, track.proxy, destFormat, 0, 0);
+    XMapRaised(x11, track.proxy);
+    drawProxy(track, g);
+
+    /*
+     * Hide the window itself until it arrives, or there'd be two of it.
+     * This takes a compositing manager: without one, it stays where it is.
+     */
+    int actualFormat;
+    unsigned long items;
+    unsigned char *prop;
+    track.opacity = -1;
+    if (x11.getProperty(track.win, x11.NetWmOpacity, XA_CARDINAL, &actualFormat, &items, &prop, 1) == 0) {
+        if (actualFormat == 32 && items == 1)
+            track.opacity = *(long *)prop & 0xffffffff;
+        XFree(prop);
+    }
+    long transparent = 0;
+    XChangeProperty(x11, track.win, x11.NetWmOpacity, XA_CARDINAL, 32, PropModeReplace,
+          (unsigned char *)&transparent, 1);
+
+    // We keep the proxy up until we see the window arrive.
+    x11.selectInput(track.win, StructureNotifyMask);
+    return true;
+}
+
+void
+Glide::drawProxy(Track &track, const Geometry &g)
+{
+    unsigned width = std::max(1U, g.size.width), height = std::max(1U, g.size.height);
+    XMoveResizeWindow(x11, track.proxy, g.x, g.y, width, height);
+    XTransform scale = {{
+        { XDoubleToFixed(double(track.snapshot.width) / width), 0, 0 },
+        { 0, XDoubleToFixed(double(track.snapshot.height) / height), 0 },
+        { 0, 0, XDoubleToFixed(1) }
+    }};
+    XRenderSetPictureTransform(x11, track.source, &scale);
+    XRenderComposite(x11, PictOpSrc, track.source, None, track.dest,
+            0, 0, 0, 0, 0, 0, width, height);
+}
+
+void
+Glide::dropProxy(Track &track)
+{
+    if (track.proxy == None)
+        return;
+    XRenderFreePicture(x11, track.dest);
+    XRenderFreePicture(x11, track.source);
+    XFreePixmap(x11, track.pixmap);
+    XDestroyWindow(x11, track.proxy);
+    XCompositeUnredirectWindow(x11, track.win, CompositeRedirectAutomatic);
+    if (track.opacity == -1)
+        XDeleteProperty(x11, track.win, x11.NetWmOpacity);
+    else
+        XChangeProperty(x11, track.win, x11.NetWmOpacity, XA_CARDINAL, 32, PropModeReplace,
+              (unsigned char *)&track.opacity, 1);
+    track.proxy = None;
+}
+
+/*
+ * Find the clients that will tell us when they've repainted after a resize,
+ * and set up alarms to hear from them. _NET_WM_SYNC_REQUEST is for the WM
+ * to send: if it does, we'd fight it over the counter's values, so we only
+ * watch the counter move as the client answers the WM.
+ */
+void
+Glide::findSyncCounters()
+{
+    PropertyBatch batch(x11);
+    for (auto &track : tracks) {
+        batch.request(track.win, x11.WmProtocols, XA_ATOM);
+        batch.request(track.win, x11.NetWmSyncRequestCounter, x11.Cardinal);
+    }
+    auto supportedTicket = batch.request(x11.root, x11.NetSupported, XA_ATOM, 4096);
+    std::vector<long> supported;
+    batch.cardinals(supportedTicket, supported);
+    wmSyncs = std::find(supported.begin(), supported.end(), long(x11.NetWmSyncRequest)) != supported.end();
+    for (size_t i = 0; i < tracks.size(); ++i) {
+        Track &track = tracks[i];
+        std::vector<long> protocols, counters;
+        if (!batch.cardinals(i * 2, protocols) || !batch.cardinals(i * 2 + 1, counters)
+                || counters.empty())
+            continue;
+        if (std::find(protocols.begin(), protocols.end(), long(x11.NetWmSyncRequest)) == protocols.end())
+            continue;
+        if (!x11.syncExtension())
+            return;
+
+        // Start from where the counter is now, so the alarm waits for our requests.
+        XSyncValue value;
+        RoundTrip wait(x11);
+        if (!XSyncQueryCounter(x11, counters[0], &value))
+            continue;
+        track.counter = counters[0];
+        track.syncValue = track.counterValue
+            = (int64_t(XSyncValueHigh32(value)) << 32) | XSyncValueLow32(value);
+
+        XSyncAlarmAttributes attrs;
+        attrs.trigger.counter = track.counter;
+        attrs.trigger.value_type = XSyncAbsolute;
+        attrs.trigger.test_type = XSyncPositiveComparison;
+        XSyncIntsToValue(&attrs.trigger.wait_value, track.syncValue & 0xffffffff, track.syncValue >> 32);
+        XSyncIntToValue(&attrs.delta, 0);
+        attrs.events = True;
+        track.alarm = XSyncCreateAlarm(x11, XSyncCACounter | XSyncCAValueType
+                | XSyncCATestType | XSyncCAValue | XSyncCADelta | XSyncCAEvents, &attrs);
+    }
+}
+
+/*
+ * Ask the client to bump its counter once it has repainted for the
+ * configure that follows, and move the alarm along to wait for that. If
+ * the WM asks it instead, just wait for the counter to move on.
+ */
+void
+Glide::syncRequest(Track &track, const timespec &now)
+{
+    track.syncValue = (wmSyncs ? track.counterValue : track.syncValue) + 1;
+    XSyncAlarmAttributes attrs;
+    XSyncIntsToValue(&attrs.trigger.wait_value, track.syncValue & 0xffffffff, track.syncValue >> 32);
+    XSyncChangeAlarm(x11, track.alarm, XSyncCAValue, &attrs);
+    track.repainting = true;
+    track.syncSent = now;
+    if (wmSyncs)
+        return;
+
+    XEvent e;
+    memset(&e, 0, sizeof e);
+    XClientMessageEvent &ec = e.xclient;
+    ec.type = ClientMessage;
+    ec.window = track.win;
+    ec.message_type = x11.WmProtocols;
+    ec.format = 32;
+    ec.data.l[0] = x11.NetWmSyncRequest;
+    ec.data.l[1] = CurrentTime;
+    ec.data.l[2] = track.syncValue & 0xffffffff;
+    ec.data.l[3] = track.syncValue >> 32;
+    XSendEvent(x11, track.win, False, NoEventMask, &e);
+}
+
+bool
+Glide::waitsForEvents() const
+{
+    if (options.inflight)
+        return true;
+    for (auto &track : tracks)
+        if (track.counter != None)
+            return true;
+    return false;
+}
+
+void
+Glide::retarget(Window win, const Geometry &to)
+{
+    for (auto &track : tracks) {
+        if (track.win != win)
+            continue;
+        track.from = at(track, track.shown);
+        track.to = to;
+        track.shown = 0;
+        // The last glide's proxy may have come down when the window arrived.
+        if (proxies && track.proxy == None)
+            makeProxy(track);
+    }
+    reached = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+void
+Glide::begin()
+{
+    double fps = options.fps;
+    if (fps <= 0)
+        fps = tracks.empty() ? 60 : x11.refreshRate(x11.monitorAt(tracks[0].to));
+    period = 1e9 / fps;
+    frames = std::max(1L, lround(options.duration * fps / 1000));
+    reached = 0;
+    // To pace ourselves to the WM, we need to see it configure the windows.
+    if (options.inflight)
+        for (auto &track : tracks)
+            x11.selectInput(track.win, StructureNotifyMask);
+    if (options.syncRequest)
+        findSyncCounters();
+    if (options.proxy)
+        makeProxies();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+bool
+Glide::landed()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (auto &track : tracks) {
+        expire(track, now);
+        if (track.proxy != None && !track.inflight.empty())
+            return false;
+    }
+    return true;
+}
+
+bool
+Glide::done() const
+{
+    for (auto &track : tracks)
+        if (track.shown != frames)
+            return false;
+    return reached == frames;
+}
+
+Geometry
+Glide::at(const Track &track, int frame) const
+{
+    if (frame >= frames)
+        return track.to;
+    double p = ease(options.easing, double(frame) / frames);
+    auto lerp = [p](double from, double to) { return lround(from + (to - from) * p); };
+    Geometry g;
+    g.x = lerp(track.from.x, track.to.x);
+    g.y = lerp(track.from.y, track.to.y);
+    g.size.width = lerp(track.from.size.width, track.to.size.width);
+    g.size.height = lerp(track.from.size.height, track.to.size.height);
+    return g;
+}
+
+// How long we wait for the WM to act on a frame before assuming it never will.
+static long
+staleAfter(const GlideOptions &options)
+{
+    return std::max(options.jumpLatency * 4, 100) * 1000000L;
+}
+
+/*
+ * How long we wait for a client to repaint. Not every configure gets one,
+ * so this is as long as we'd let the WM take to act on a frame at all.
+ */
+static long
+repaintStaleAfter(const GlideOptions &options)
+{
+    return std::max(options.jumpLatency, 1) * 1000000L;
+}
+
+timespec
+Glide::deadline() const
+{
+    // Frame n goes out n periods after we start, so the last lands at the end of the duration.
+    if (reached < frames)
+        return nsecAdd(start, period * (reached + 1));
+
+    // All that's left is last frames waiting on the WM or client: give up on them eventually.
+    timespec rv = nsecAdd(start, period * frames + staleAfter(options));
+    for (auto &track : tracks) {
+        if (track.shown == frames)
+            continue;
+        if (!track.inflight.empty()) {
+            timespec stale = nsecAdd(track.inflight.front().sent, staleAfter(options));
+            if (nsecDiff(stale, rv) < 0)
+                rv = stale;
+        }
+        if (track.repainting) {
+            timespec stale = nsecAdd(track.syncSent, repaintStaleAfter(options));
+            if (nsecDiff(stale, rv) < 0)
+                rv = stale;
+        }
+    }
+    return rv;
+}
+
+void
+Glide::expire(Track &track, const timespec &now)
+{
+    while (!track.inflight.empty()
+            && nsecDiff(now, track.inflight.front().sent) > staleAfter(options))
+        track.inflight.pop_front();
+    if (track.repainting && nsecDiff(now, track.syncSent) > repaintStaleAfter(options))
+        track.repainting = false;
+}
+
+void
+Glide::acknowledge(Track &track, const XConfigureEvent &event)
+{
+    if (track.inflight.empty())
+        return;
+    /*
+     * The WM may fold several of our requests into one configure, so the
+     * newest frame of the size we were told about is done, along with all
+     * those before it. Otherwise, assume it's dealt with the oldest.
+     */
+    size_t acked = 0;
+    for (size_t i = track.inflight.size(); i-- > 0;) {
+        const Geometry &g = track.inflight[i].geom;
+        if (int(g.size.width) == event.width && int(g.size.height) == event.height) {
+            acked = i;
+            break;
+        }
+    }
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long latency = nsecDiff(now, track.inflight[acked].sent);
+    x11.wmLatency = x11.wmLatency < 0 ? latency : (x11.wmLatency * 3 + latency) / 4;
+    track.inflight.erase(track.inflight.begin(), track.inflight.begin() + acked + 1);
+}
+
+void
+Glide::handleEvent(const XEvent &event)
+{
+    if (event.type == ConfigureNotify) {
+        for (auto &track : tracks)
+            if (track.win == event.xconfigure.window)
+                acknowledge(track, event.xconfigure);
+    } else if (x11.syncEventBase && event.type == x11.syncEventBase + XSyncAlarmNotify) {
+        auto &alarm = (const XSyncAlarmNotifyEvent &)event;
+        for (auto &track : tracks) {
+            if (track.alarm != alarm.alarm)
+                continue;
+            int64_t value = (int64_t(XSyncValueHigh32(alarm.counter_value)) << 32)
+                    | XSyncValueLow32(alarm.counter_value);
+            track.counterValue = std::max(track.counterValue, value);
+            if (value >= track.syncValue)
+                track.repainting = false;
+        }
+    }
+}
+
+void
+Glide::pump()
+{
+    XEvent event;
+    while (XCheckTypedEvent(x11, ConfigureNotify, &event)) {
+        handleEvent(event);
+        x11.handleEvent(event);
+    }
+    while (x11.syncEventBase
+            && XCheckTypedEvent(x11, x11.syncEventBase + XSyncAlarmNotify, &event))
+        handleEvent(event);
+}
+
+void
+Glide::step()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = nsecDiff(now, start);
+    // If we're running late, skip straight to the frame we should be showing.
+    int frame = std::min(long(frames), std::max(long(reached), elapsed / period));
+    // If the WM can't keep up with us at all, don't make it try.
+    if (options.inflight && x11.wmLatency > options.jumpLatency * 1000000L)
+        frame = frames;
+
+    bool sent = false;
+    for (auto &track : tracks) {
+        expire(track, now);
+        if (track.shown >= frame)
+            continue;
+        // Drop frames for a window until the WM and client have caught up with it.
+        if (options.inflight && track.inflight.size() >= options.inflight)
+            continue;
+        if (track.repainting)
+            continue;
+        Geometry g = at(track, frame);
+        Geometry last = at(track, track.shown);
+        track.shown = frame;
+        if (memcmp(&g, &last, sizeof g) == 0 && frame != frames)
+            continue;
+        if (track.proxy != None) {
+            // Only the proxy moves, until the last frame.
+            drawProxy(track, g);
+            if (frame == frames) {
+                x11.sendGeometry(track.win, g);
+                track.inflight.push_back(Frame { g, now });
+            }
+            sent = true;
+            continue;
+        }
+        // Clients only repaint for frames that change their size.
+        if (track.counter != None && (g.size.width != last.size.width
+                || g.size.height != last.size.height))
+            syncRequest(track, now);
+        x11.sendGeometry(track.win, g);
+        if (options.inflight)
+            track.inflight.push_back(Frame { g, now });
+        sent = true;
+    }
+    reached = frame;
+    if (sent) {
+        XFlush(x11);
+        if (!x11.tracePath.empty()) {
+            long due = nsecDiff(start, timespec()) + period * frame;
+            long at = nsecDiff(now, timespec());
+            sends.push_back(Sent { frame, due, at });
+            x11.traceInstant("frame " + std::to_string(frame), at,
+                    "{\"dueMs\":" + std::to_string(due / 1e6)
+                    + ",\"lateMs\":" + std::to_string((at - due) / 1e6) + "}");
+        }
+    }
+}
+
+/*
+ * Report how evenly the frames went out: a histogram of the intervals
+ * between them, and how far past its due time the last one was.
+ */
+void
+Glide::reportFrames()
+{
+    if (sends.empty())
+        return;
+    long begun = nsecDiff(start, timespec());
+    x11.trace("glide", begun, sends.back().sent);
+
+    constexpr long BUCKET = 2000000; // nanoseconds
+    std::map<long, int> buckets;
+    int most = 0;
+    for (size_t i = 1; i < sends.size(); ++i)
+        most = std::max(most, ++buckets[(sends[i].sent - sends[i - 1].sent) / BUCKET]);
+    long overrun = sends.back().sent - (begun + period * frames);
+    std::clog << "glide: " << sends.size() << " frames sent of " << frames
+        << ", last " << overrun / 1e6 << " ms late" << std::endl;
+    for (auto &bucket : buckets) {
+        char label[40];
+        snprintf(label, sizeof label, "%4ld-%-4ld ms |", bucket.first * BUCKET / 1000000,
+                (bucket.first + 1) * BUCKET / 1000000);
+        std::clog << label << std::string(bucket.second * 40 / most, '#')
+            << " " << bucket.second << std::endl;
+    }
+    sends.clear();
+}
+
+void
+Glide::run()
+{
+    begin();
+    complete();
+}
+
+void
+Glide::complete()
+{
+    for (step(); !done(); step()) {
+        timespec next = deadline();
+        if (!waitsForEvents()) {
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0) == EINTR)
+                ;
+            continue;
+        }
+        // Wake for the next frame, or when the WM or client tells us it's caught up.
+        pump();
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long wait = nsecDiff(next, now);
+        if (wait > 0 && !XPending(x11)) {
+            timespec timeout = nsecAdd(timespec(), wait);
+            pollfd pfd;
+            pfd.fd = ConnectionNumber(x11.display);
+            pfd.events = POLLIN;
+            ppoll(&pfd, 1, &timeout, 0);
+        }
+        pump();
+    }
+    // Make sure the last frame has arrived before we move on.
+    {
+        RoundTrip wait(x11);
+        XSync(x11, False);
+    }
+    finish();
+}
+
+void
+Glide::finish()
+{
+    // Leave the proxies up until the WM has moved the windows they cover.
+    timespec now, until;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    until = nsecAdd(now, staleAfter(options));
+    for (;;) {
+        pump();
+        bool waiting = false;
+        for (auto &track : tracks)
+            if (track.proxy != None && !track.inflight.empty())
+                waiting = true;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long wait = nsecDiff(until, now);
+        if (!waiting || wait <= 0)
+            break;
+        if (!XPending(x11)) {
+            timespec timeout = nsecAdd(timespec(), wait);
+            pollfd pfd;
+            pfd.fd = ConnectionNumber(x11.display);
+            pfd.events = POLLIN;
+            ppoll(&pfd, 1, &timeout, 0);
+        }
+    }
+    for (auto &track : tracks) {
+        if (track.proxy != None) {
+            dropProxy(track);
+            track.inflight.clear();
+        }
+    }
+    XFlush(x11);
+    reportFrames();
+}
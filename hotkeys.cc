@@ -0,0 +1,272 @@
+#include "fling.h"
+#include <errno.h>
+#include <fstream>
+#include <sstream>
+#include <sys/inotify.h>
+#include <X11/keysym.h>
+
+/*
+ * The bindings file has one binding per line: a key chord, then the fling
+ * command line to run when it's pressed, eg
+ *
+ *     Super+Left          l
+ *     Super+Shift+Up      -f
+ *     Super+KP_Add        -O 0.1
+ *
+ * Blank lines, and everything after a '#', are ignored. A chord is any
+ * number of modifiers (Shift, Control, Alt, Super, Mod1 to Mod5), then a
+ * keysym name, joined with '+'.
+ */
+
+static const struct {
+    const char *name;
+    unsigned mask;
+} modifierNames[] = {
+    { "shift", ShiftMask },
+    { "control", ControlMask },
+    { "ctrl", ControlMask },
+    { "alt", Mod1Mask },
+    { "super", Mod4Mask },
+    { "mod1", Mod1Mask },
+    { "mod2", Mod2Mask },
+    { "mod3", Mod3Mask },
+    { "mod4", Mod4Mask },
+    { "mod5", Mod5Mask },
+};
+
+std::string
+bindingsPath()
+{
+    const char *override = getenv("FLING_BINDINGS");
+    if (override)
+        return override;
+    const char *config = getenv("XDG_CONFIG_HOME");
+    if (config && *config)
+        return std::string(config) + "/fling/bindings";
+    const char *home = getenv("HOME");
+    return std::string(home ? home : "") + "/.config/fling/bindings";
+}
+
+FileWatch::FileWatch(const std::string &path_)
+    : path(path_)
+    , inotify(-1)
+    , wd(-1)
+{
+    if (path.find('/') == std::string::npos)
+        return;
+    inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify != -1)
+        arm();
+}
+
+FileWatch::~FileWatch()
+{
+    if (inotify != -1)
+        close(inotify);
+}
+
+// Watch the file's directory, or the nearest ancestor of it that exists.
+void
+FileWatch::arm()
+{
+    if (wd != -1)
+        inotify_rm_watch(inotify, wd);
+    wd = -1;
+    std::string dir = path;
+    for (;;) {
+        auto slash = dir.rfind('/');
+        if (slash == std::string::npos)
+            return;
+        entry = dir.substr(slash + 1);
+        dir.erase(slash);
+        watched = dir.empty() ? "/" : dir;
+        wd = inotify_add_watch(inotify, watched.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO
+                | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (wd != -1 || errno != ENOENT || dir.empty())
+            return;
+    }
+}
+
+bool
+FileWatch::changed()
+{
+    char buf[4096] __attribute__((aligned(__alignof__(inotify_event))));
+    bool changed = false, moved = false;
+    for (;;) {
+        ssize_t rc = read(inotify, buf, sizeof buf);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            break;
+        for (char *p = buf; p < buf + rc; ) {
+            auto event = (const inotify_event *)p;
+            p += sizeof *event + event->len;
+            if (event->wd != wd)
+                continue; // from a watch we've since moved.
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+                moved = true; // the directory itself has gone.
+            else if (event->len != 0 && entry == event->name)
+                changed = true;
+        }
+    }
+    // A directory on the way to the file has come or gone: watch the nearest one again.
+    if (moved || (changed && watched.size() + entry.size() + 1 < path.size())) {
+        arm();
+        changed = true;
+    }
+    return changed;
+}
+
+Hotkeys::Hotkeys(X11Env &x11_, bool watching)
+    : x11(x11_)
+    , path(bindingsPath())
+    , ignoredModifiers(LockMask)
+{
+    if (watching)
+        watch.reset(new FileWatch(path));
+    load();
+}
+
+Hotkeys::~Hotkeys()
+{
+    grab(false);
+}
+
+// Parse "Super+Shift+Left" into modifiers and a keycode.
+static bool
+parseChord(X11Env &x11, const std::string &chord, unsigned *modifiers, KeyCode *code)
+{
+    *modifiers = 0;
+    std::string rest = chord;
+    for (;;) {
+        auto plus = rest.find('+');
+        if (plus == std::string::npos || plus == rest.size() - 1)
+            break;
+        std::string name = rest.substr(0, plus);
+        for (auto &c : name)
+            c = tolower(c);
+        bool found = false;
+        for (auto &mod : modifierNames) {
+            if (name == mod.name) {
+                *modifiers |= mod.mask;
+                found = true;
+            }
+        }
+        if (!found)
+            return false;
+        rest = rest.substr(plus + 1);
+    }
+    KeySym sym = XStringToKeysym(rest.c_str());
+    if (sym == NoSymbol)
+        return false;
+    *code = XKeysymToKeycode(x11, sym);
+    return *code != 0;
+}
+
+/*
+ * Whatever the state of NumLock and CapsLock, a chord should still work: find
+ * the modifier NumLock is on, so we can grab with and without it.
+ */
+static unsigned
+numLockMask(X11Env &x11)
+{
+    unsigned mask = 0;
+    RoundTrip wait(x11);
+    XModifierKeymap *map = XGetModifierMapping(x11);
+    KeyCode numLock = XKeysymToKeycode(x11, XK_Num_Lock);
+    for (int mod = 0; map && numLock && mod < 8; ++mod)
+        for (int i = 0; i < map->max_keypermod; ++i)
+            if (map->modifiermap[mod * map->max_keypermod + i] == numLock)
+                mask = 1 << mod;
+    if (map)
+        XFreeModifiermap(map);
+    return mask;
+}
+
+void
+Hotkeys::grab(bool on)
+{
+    unsigned numLock = ignoredModifiers & ~LockMask;
+    unsigned variants[] = { 0, LockMask, numLock, LockMask | numLock };
+    for (auto &binding : bindings) {
+        for (auto extra : variants) {
+            if (on)
+                XGrabKey(x11, binding.code, binding.modifiers | extra, x11.root,
+                        False, GrabModeAsync, GrabModeAsync);
+            else
+                XUngrabKey(x11, binding.code, binding.modifiers | extra, x11.root);
+        }
+    }
+    XFlush(x11);
+}
+
+void
+Hotkeys::load()
+{
+    grab(false);
+    bindings.clear();
+    ignoredModifiers = LockMask | numLockMask(x11);
+
+    std::ifstream in(path);
+    std::string line;
+    for (int lineno = 1; std::getline(in, line); ++lineno) {
+        auto hash = line.find('#');
+        if (hash != std::string::npos)
+            line.erase(hash);
+        std::istringstream words(line);
+        std::string chord, arg;
+        if (!(words >> chord))
+            continue;
+        Binding binding;
+        binding.args.push_back("fling");
+        while (words >> arg)
+            binding.args.push_back(arg);
+        if (binding.args.size() == 1 || !parseChord(x11, chord, &binding.modifiers, &binding.code)) {
+            std::clog << path << ":" << lineno << ": bad binding" << std::endl;
+            continue;
+        }
+        bindings.push_back(binding);
+    }
+    grab(true);
+    if (!bindings.empty())
+        std::clog << "loaded " << bindings.size() << " bindings from " << path << std::endl;
+}
+
+bool
+Hotkeys::changed()
+{
+    bool reload = watch && watch->changed();
+    if (reload)
+        load();
+    return reload;
+}
+
+bool
+Hotkeys::handleEvent(const XEvent &event)
+{
+    if (event.type == MappingNotify) {
+        // Keycodes may have moved under our grabs.
+        XMappingEvent mapping = event.xmapping;
+        XRefreshKeyboardMapping(&mapping);
+        if (mapping.request != MappingPointer)
+            load();
+        return false;
+    }
+    if (event.type != KeyPress)
+        return false;
+    unsigned state = event.xkey.state & ~ignoredModifiers;
+    for (auto &binding : bindings) {
+        if (binding.code != event.xkey.keycode || binding.modifiers != state)
+            continue;
+        std::vector<char *> args;
+        for (auto &arg : binding.args)
+            args.push_back(const_cast<char *>(arg.c_str()));
+        args.push_back(0);
+        // Nothing ran us, so there's no launcher to wait for the focus to leave.
+        requester = 0;
+        x11.resetStats(getenv("FLING_STATS"), getenv("FLING_TRACE"));
+        runResident(x11, args.size() - 1, &args[0]);
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,30 @@
+#include "fling.h"
+
+void
+placeWindows(X11Env &x11, const std::vector<Placement> &placements, int screen,
+      const MoveOptions &options)
+{
+    if (placements.empty())
+        return;
+    auto plans = planPlacements(x11, placements, screen, options.border);
+
+    Glide motion(x11, options.glideOptions);
+    Transaction changes(x11);
+    for (auto &plan : plans) {
+        // Remove any toggles that make the window size moot.
+        changes.state(plan.win, x11.NetWmStateShaded, X11Env::REMOVE);
+        changes.state(plan.win, x11.NetWmStateMaximizedHoriz, X11Env::REMOVE, x11.NetWmStateMaximizedVert);
+        changes.state(plan.win, x11.NetWmStateFullscreen, X11Env::REMOVE);
+        rememberPlacement(x11, plan.win, plan.screen, placements[plan.index].location);
+        if (options.glide)
+            motion.add(plan.win, plan.from, plan.to);
+        else
+            changes.geometry(plan.win, plan.to);
+    }
+
+    x11.phase("glide");
+    // Without a glide, the moves are in the transaction: wait for them.
+    changes.commit(!options.glide);
+    if (options.glide)
+        motion.run();
+}
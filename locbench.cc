@@ -0,0 +1,286 @@
+/*
+ * Compiled control strings (Location, in place.cc) against the interpreter
+ * they replaced, which parsed and applied a string a character at a time.
+ *
+ *   locbench [ -t seconds ]          throughput of each, on typical strings
+ *   locbench -f [ -n count ] [ -s seed ]
+ *                                    fuzz: random strings, spaces and frames
+ *
+ * The fuzzer checks that the compiled form puts the window exactly where the
+ * interpreter did, but for Location's deliberate changes: it refuses strings
+ * that would take the window out of its space, clips to the usable area,
+ * and never lets the width or height wrap around.
+ */
+#include "fling.h"
+#include <functional>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <random>
+
+/*
+ * The interpreter, verbatim from before Location, but for two lines: it
+ * returns false on a bad string rather than calling usage(), and where it
+ * called adjustForStruts(), which needs a display, it clips to "usable",
+ * the monitor less its struts, as Location does. Strings Location refuses
+ * (see refused()) must not get here: the interpreter would happily divide
+ * by zero with them.
+ */
+static bool
+interpret(const Geometry &usable, Geometry &geom, unsigned *border,
+      const long *frame, const char *location)
+{
+    char curChar;
+
+    for (const char *path = location; (curChar = *path) != 0; ++path) {
+        double num = 1, denom = 2;
+        if (isdigit(curChar) || curChar == '.') {
+            char *newpath;
+            num = 1;
+            denom = strtod(path, &newpath);
+            path = newpath;
+            curChar = *path;
+            if (curChar == '/') {
+               num = denom;
+               denom = strtod(path + 1, &newpath);
+               path = newpath;
+               curChar = *path;
+            }
+        }
+
+        switch (curChar) {
+            case 'b':
+                *border = denom;
+                break;
+            case 'r':
+                // move to right
+                geom.x += geom.size.width - geom.size.width * (num / denom);
+                // and then...
+            case 'l':
+                // cut out right hand side.
+                geom.size.width = geom.size.width * num / denom;
+                break;
+            case 'd':
+                geom.y += geom.size.height - geom.size.height * (num / denom);
+                // and then...
+            case 'u':
+                geom.size.height = geom.size.height * (num / denom);
+                break;
+            case 'h': {
+                // reduce horizontal size and centre
+                int newsize = geom.size.width * (num / denom);
+                geom.x += (geom.size.width - newsize) / 2;
+                geom.size.width = newsize;
+                break;
+            }
+            case 'v': {
+                // reduce vertical size and centre
+                int newsize = geom.size.height * (num / denom);
+                geom.y += (geom.size.height - newsize) / 2;
+                geom.size.height = newsize;
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    geom = intersect(geom, usable);
+
+    // Adjust the geometry downwards to account for the frame around the window, and our border.
+    geom.size.width -= frame[0] + frame[1] + *border * 2;
+    geom.size.height -= frame[2] + frame[3] + *border * 2;
+    geom.x += frame[0] + *border;
+    geom.y += frame[2] + *border;
+    return true;
+}
+
+/*
+ * The first of Location's deliberate changes: it refuses fractions outside
+ * [0, 1] (or that aren't numbers), and borders outside [0, 0xffff], which
+ * the interpreter would apply, taking the window out of its space.
+ */
+static bool
+refused(const char *location)
+{
+    for (const char *path = location; *path != 0; ++path) {
+        double num = 1, denom = 2;
+        if (isdigit(*path) || *path == '.') {
+            char *newpath;
+            denom = strtod(path, &newpath);
+            path = newpath;
+            if (*path == '/') {
+                num = denom;
+                denom = strtod(path + 1, &newpath);
+                path = newpath;
+            }
+        }
+        if (*path == 0)
+            return false; // the interpreter rejects it too.
+        if (*path == 'b' ? !(denom >= 0 && denom <= 0xffff) : !(denom > 0 && num >= 0 && num <= denom))
+            return true;
+    }
+    return false;
+}
+
+static bool
+operator==(const Geometry &l, const Geometry &r)
+{
+    return l.x == r.x && l.y == r.y && l.size.width == r.size.width && l.size.height == r.size.height;
+}
+
+static long minTime = 1000000000; // nanoseconds each benchmark runs for.
+
+static void
+benchmark(const char *name, const std::function<void()> &op)
+{
+    unsigned long count = 0, batch = 1;
+    long start = nsecNow(), elapsed;
+    for (;;) {
+        for (unsigned long i = 0; i < batch; ++i)
+            op();
+        count += batch;
+        elapsed = nsecNow() - start;
+        if (elapsed >= minTime)
+            break;
+        if (elapsed < minTime / 100)
+            batch *= 2;
+    }
+    double perOp = double(elapsed) / count;
+    printf("%-12s %12lu %10.1f %14.0f\n", name, count, perOp, 1e9 / perOp);
+    fflush(stdout);
+}
+
+static int
+bench()
+{
+    static const char *strings[] = { "l", "dr", "2/3dl", "uldr", "1/3h1/2v", "3/4r0b", "1.5u" };
+    const size_t count = sizeof strings / sizeof strings[0];
+    std::vector<std::shared_ptr<const Location>> compiled;
+    for (auto s : strings)
+        compiled.push_back(Location::compile(s));
+    Geometry usable = { { 1920, 1048 }, 0, 32 };
+    long frame[4] = { 1, 1, 24, 1 };
+    volatile int sink = 0;
+    size_t n = 0;
+
+    printf("%-12s %12s %10s %14s\n", "engine", "ops", "ns/op", "ops/s");
+    benchmark("interpreted", [&] {
+        Geometry geom = usable;
+        unsigned border = 2;
+        interpret(usable, geom, &border, frame, strings[n++ % count]);
+        sink = geom.x;
+    });
+    n = 0;
+    benchmark("cached", [&] {
+        Geometry geom = usable;
+        unsigned border = 2;
+        locate(usable, geom, &border, frame, strings[n++ % count]);
+        sink = geom.x;
+    });
+    n = 0;
+    benchmark("compiled", [&] {
+        Geometry geom = usable;
+        unsigned border = 2;
+        compiled[n++ % count]->apply(usable, geom, &border, frame);
+        sink = geom.x;
+    });
+    (void)sink;
+    return 0;
+}
+
+static int
+fuzz(unsigned long iterations, unsigned seed)
+{
+    static const char alphabet[] = "0123456789./lrudhvbx";
+    static const char *aliases[] = { "top", "bottomright", "left", "topleftx" };
+    std::mt19937 random(seed);
+    auto upto = [&](long n) { return long(random() % n); };
+    unsigned long failures = 0, accepted = 0;
+
+    for (unsigned long i = 0; i < iterations; ++i) {
+        std::string location;
+        if (upto(50) == 0) {
+            location = aliases[upto(4)];
+        } else {
+            for (long len = upto(12); len > 0; --len)
+                location += alphabet[upto(sizeof alphabet - 1)];
+        }
+        Geometry usable = { { unsigned(upto(4000)), unsigned(upto(3000)) }, int(upto(8000) - 4000), int(upto(8000) - 4000) };
+        Geometry start = usable;
+        if (upto(2)) // as with -x, start from where the window is.
+            start = { { unsigned(upto(5000)), unsigned(upto(5000)) }, int(upto(10000) - 5000), int(upto(10000) - 5000) };
+        long frame[4] = { upto(40), upto(40), upto(60), upto(40) };
+        unsigned initialBorder = upto(20);
+
+        Geometry expect = start, got = start;
+        unsigned expectBorder = initialBorder, gotBorder = initialBorder;
+        const char *resolved = location.c_str();
+        if (location == "top")
+            resolved = "u";
+        else if (location == "bottomright")
+            resolved = "dr";
+        else if (location == "left")
+            resolved = "l";
+        bool interpreted = !refused(resolved)
+            && interpret(usable, expect, &expectBorder, frame, resolved);
+        auto compiled = Location::compile(location.c_str());
+        bool ok = interpreted == (compiled != 0);
+        if (ok && compiled) {
+            ++accepted;
+            compiled->apply(usable, got, &gotBorder, frame);
+            // The last deliberate change: where a size reached zero, or wrapped, Location leaves a pixel.
+            if (expect.size.width == 0 || expect.size.width > UINT_MAX / 2)
+                expect.size.width = 1;
+            if (expect.size.height == 0 || expect.size.height > UINT_MAX / 2)
+                expect.size.height = 1;
+            ok = got == expect && gotBorder == expectBorder
+                && Location::compile(location.c_str()) == compiled;
+        }
+        if (!ok) {
+            ++failures;
+            std::cout << "\"" << location << "\" in " << usable << " from " << start
+                << ": interpreted " << (interpreted ? "" : "(rejected) ") << expect
+                << ", compiled " << (compiled ? "" : "(rejected) ") << got << std::endl;
+        }
+    }
+    printf("%lu strings, %lu accepted, %lu mismatches\n", iterations, accepted, failures);
+    return failures != 0;
+}
+
+static void
+usage()
+{
+    std::clog << "usage: locbench [ -t seconds ] | -f [ -n count ] [ -s seed ]" << std::endl;
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    bool fuzzing = false;
+    unsigned long iterations = 1000000;
+    unsigned seed = time(0);
+    int c;
+    while ((c = getopt(argc, argv, "fn:s:t:")) != -1) {
+        switch (c) {
+            case 'f':
+                fuzzing = true;
+                break;
+            case 'n':
+                iterations = strtoul(optarg, 0, 0);
+                break;
+            case 's':
+                seed = strtoul(optarg, 0, 0);
+                break;
+            case 't':
+                minTime = atof(optarg) * 1e9;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (!fuzzing)
+        return bench();
+    printf("seed %u\n", seed);
+    return fuzz(iterations, seed);
+}
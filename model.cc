@@ -0,0 +1,133 @@
+#include "model.h"
+
+DisplayModel::DisplayModel(unsigned width, unsigned height)
+{
+    rootGeom.x = rootGeom.y = 0;
+    rootGeom.size.width = width;
+    rootGeom.size.height = height;
+}
+
+void
+DisplayModel::addMonitor(const Geometry &geom)
+{
+    screens.push_back(geom);
+    forget();
+}
+
+Window
+DisplayModel::addClient(const Geometry &geom, long desktop)
+{
+    Client &client = clients[nextWindow];
+    client.geom = geom;
+    // Something like a typical WM's title bar and borders.
+    client.frame[0] = client.frame[1] = client.frame[3] = 1;
+    client.frame[2] = 24;
+    client.desktop = desktop;
+    client.dock = false;
+    clientList.push_back(nextWindow);
+    usableAreas.clear();
+    return nextWindow++;
+}
+
+Window
+DisplayModel::addDock(const Geometry &monitor, unsigned height, long desktop)
+{
+    Geometry geom = monitor;
+    geom.size.height = height;
+    Window win = addClient(geom, desktop);
+    Client &client = clients[win];
+    memset(client.frame, 0, sizeof client.frame);
+    client.dock = true;
+    memset(&client.strut, 0, sizeof client.strut);
+    client.strut.top = monitor.y + height;
+    client.strut.rtop.start = monitor.x;
+    client.strut.rtop.end = monitor.x + monitor.size.width - 1;
+    return win;
+}
+
+void
+DisplayModel::advance(long now)
+{
+    while (!moves.empty() && moves.front().due <= now) {
+        auto it = clients.find(moves.front().win);
+        if (it != clients.end())
+            it->second.geom = moves.front().geom;
+        moves.pop_front();
+    }
+}
+
+void
+DisplayModel::forget()
+{
+    monitors.clear();
+    usableAreas.clear();
+}
+
+void
+DisplayModel::detectMonitors()
+{
+    ++operations;
+    monitors = screens;
+    if (monitors.empty())
+        monitors.push_back(rootGeom);
+}
+
+void
+DisplayModel::readDesktops(DesktopInfo &info)
+{
+    ++operations;
+    info.workarea = workarea;
+    info.currentDesktop = currentDesktop;
+    info.clients = clientList;
+}
+
+void
+DisplayModel::readStruts(const std::vector<Window> &windows, std::vector<ClientStruts> &struts)
+{
+    ++operations;
+    for (auto win : windows) {
+        auto it = clients.find(win);
+        if (it == clients.end() || !it->second.dock)
+            continue;
+        ClientStruts client;
+        client.desktop = it->second.desktop;
+        client.strut = it->second.strut;
+        struts.push_back(client);
+    }
+}
+
+void
+DisplayModel::describeWindows(const std::vector<Window> &windows, std::vector<WindowInfo> &infos)
+{
+    ++operations;
+    infos.resize(windows.size());
+    for (size_t i = 0; i < windows.size(); ++i) {
+        WindowInfo &info = infos[i];
+        auto it = clients.find(windows[i]);
+        info.exists = it != clients.end();
+        if (!info.exists)
+            continue;
+        info.geom = it->second.geom;
+        memcpy(info.frame, it->second.frame, sizeof info.frame);
+        info.desktop = it->second.desktop;
+    }
+}
+
+int
+DisplayModel::monitorForWindow(Window win)
+{
+    ++operations;
+    auto it = clients.find(win);
+    return it == clients.end() ? 0 : monitorAt(it->second.geom);
+}
+
+void
+DisplayModel::sendGeometry(Window win, const Geometry &geom) const
+{
+    ++operations;
+    Move move;
+    move.due = nsecNow() + latency;
+    move.win = win;
+    move.geom = geom;
+    moves.push_back(move);
+}
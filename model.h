@@ -0,0 +1,52 @@
+#pragma once
+#include "wmhack.h"
+#include <deque>
+
+/*
+ * A display that exists only in memory: monitors, client windows, and docks
+ * with struts, standing in for the X server and WM behind a DisplayBackend.
+ * Like a real WM, it takes "latency" nanoseconds to act on a geometry change:
+ * sendGeometry only queues the move, and advance() carries out those due.
+ */
+class DisplayModel : public DisplayBackend {
+public:
+    struct Client {
+        Geometry geom;
+        long frame[4];
+        long desktop; // -1 for all desktops.
+        bool dock;
+        PartialStrut strut; // if it's a dock.
+    };
+    std::vector<Geometry> screens; // what detectMonitors() finds.
+    std::map<Window, Client> clients;
+    std::vector<Window> clientList; // _NET_CLIENT_LIST, in mapping order.
+    std::vector<long> workarea; // _NET_WORKAREA, if the "WM" sets it.
+    long currentDesktop = 0;
+    long latency = 0;
+    mutable unsigned long operations = 0; // backend calls, as round trips are to X11Env.
+
+    DisplayModel(unsigned width, unsigned height);
+    void addMonitor(const Geometry &);
+    Window addClient(const Geometry &, long desktop = -1);
+    // A dock across the top "height" pixels of a monitor.
+    Window addDock(const Geometry &monitor, unsigned height, long desktop = -1);
+    void advance(long now); // carry out the moves due by "now".
+    size_t pending() const { return moves.size(); }
+    void forget(); // drop cached monitors and usable areas, as a RandR change would.
+
+    void detectMonitors();
+    void readDesktops(DesktopInfo &);
+    void readStruts(const std::vector<Window> &clients, std::vector<ClientStruts> &);
+    void describeWindows(const std::vector<Window> &windows, std::vector<WindowInfo> &);
+    int monitorForWindow(Window);
+    void sendGeometry(Window win, const Geometry &geom) const;
+
+private:
+    struct Move {
+        long due;
+        Window win;
+        Geometry geom;
+    };
+    mutable std::deque<Move> moves;
+    Window nextWindow = 0x1000001;
+};
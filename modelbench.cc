@@ -0,0 +1,156 @@
+/*
+ * Profile fling's geometry logic against an in-memory display (see model.h),
+ * at scales no real desktop reaches: dozens of monitors, thousands of
+ * windows, and millions of operations. Each benchmark runs for at least the
+ * given time, and we report the cost per operation, the rate, and how many
+ * backend calls each operation made.
+ */
+#include "fling.h"
+#include "model.h"
+#include <functional>
+#include <getopt.h>
+#include <stdio.h>
+
+static long minTime = 1000000000; // nanoseconds each benchmark runs for.
+
+static void
+benchmark(const char *name, DisplayModel &model, const std::function<void()> &op)
+{
+    unsigned long count = 0, batch = 1;
+    unsigned long operations = model.operations;
+    long start = nsecNow(), elapsed;
+    for (;;) {
+        for (unsigned long i = 0; i < batch; ++i)
+            op();
+        count += batch;
+        elapsed = nsecNow() - start;
+        if (elapsed >= minTime)
+            break;
+        // Don't read the clock so often that it's what we're measuring.
+        if (elapsed < minTime / 100)
+            batch *= 2;
+    }
+    double perOp = double(elapsed) / count;
+    printf("%-16s %12lu %12.1f %14.0f %10.2f\n", name, count, perOp, 1e9 / perOp,
+            double(model.operations - operations) / count);
+    fflush(stdout);
+}
+
+static void
+usage()
+{
+    std::clog << "usage: modelbench [ -m monitors ] [ -w windows ] [ -d desktops ]"
+        " [ -l latency-ms ] [ -t seconds ]" << std::endl;
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int monitorCount = 24, windowCount = 4000, desktops = 4, c;
+    long latency = 0;
+    while ((c = getopt(argc, argv, "m:w:d:l:t:")) != -1) {
+        switch (c) {
+            case 'm':
+                monitorCount = atoi(optarg);
+                break;
+            case 'w':
+                windowCount = atoi(optarg);
+                break;
+            case 'd':
+                desktops = atoi(optarg);
+                break;
+            case 'l':
+                latency = atol(optarg) * 1000000;
+                break;
+            case 't':
+                minTime = atof(optarg) * 1e9;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (monitorCount < 1 || windowCount < 1 || desktops < 1)
+        usage();
+
+    // Lay the monitors out in a grid, each with a panel along its top.
+    int cols = 1;
+    while (cols * cols < monitorCount)
+        ++cols;
+    int rows = (monitorCount + cols - 1) / cols;
+    DisplayModel model(cols * 1920, rows * 1080);
+    model.latency = latency;
+    for (int i = 0; i < monitorCount; ++i) {
+        Geometry monitor;
+        monitor.x = i % cols * 1920;
+        monitor.y = i / cols * 1080;
+        monitor.size.width = 1920;
+        monitor.size.height = 1080;
+        model.addMonitor(monitor);
+        model.addDock(monitor, 32);
+    }
+
+    // Scatter the windows over the monitors and desktops.
+    std::vector<Window> windows;
+    for (int i = 0; i < windowCount; ++i) {
+        const Geometry &monitor = model.screens[i % monitorCount];
+        Geometry geom;
+        geom.x = monitor.x + i * 37 % 1200;
+        geom.y = monitor.y + i * 53 % 600;
+        geom.size.width = 640;
+        geom.size.height = 400;
+        windows.push_back(model.addClient(geom, i / monitorCount % desktops));
+    }
+
+    // A grid layout of each monitor's windows.
+    std::vector<Placement> placements;
+    for (int i = 0; i < windowCount; ++i) {
+        Placement p;
+        p.win = windows[i];
+        p.screen = i % monitorCount;
+        size_t onMonitor = (windowCount - p.screen + monitorCount - 1) / monitorCount;
+        layoutLocation("grid", i / monitorCount, onMonitor, &p.location);
+        placements.push_back(p);
+    }
+
+    printf("%d monitors, %d windows, %d desktops\n", monitorCount, windowCount, desktops);
+    printf("%-16s %12s %12s %14s %10s\n", "benchmark", "ops", "ns/op", "ops/s", "calls/op");
+
+    static const char *locations[] = { "l", "2/3dr", "1/3h1/2v", "ul", "3/4r0b" };
+    const size_t locationCount = sizeof locations / sizeof locations[0];
+    long frame[4] = { 1, 1, 24, 1 };
+    size_t n = 0;
+    benchmark("locate", model, [&] {
+        Geometry geom = model.usableArea(0, 0);
+        unsigned border = 2;
+        locate(model.usableArea(0, 0), geom, &border, frame, locations[n++ % locationCount]);
+    });
+
+    n = 0;
+    benchmark("usable areas", model, [&] {
+        model.usableAreas.clear();
+        model.usableArea(n++ % desktops, 0);
+    });
+
+    n = 0;
+    benchmark("monitor lookup", model, [&] {
+        model.monitorForWindow(windows[n++ % windows.size()]);
+    });
+
+    benchmark("plan layout", model, [&] {
+        planPlacements(model, placements, -1, 2);
+    });
+
+    /*
+     * Not placeWindows itself, whose state changes and glides need X11Env:
+     * just the plan, and a move for each window, as it sends without a glide.
+     */
+    benchmark("plan and move", model, [&] {
+        for (auto &plan : planPlacements(model, placements, -1, 2))
+            model.sendGeometry(plan.win, plan.to);
+        model.advance(nsecNow());
+    });
+    if (model.pending() != 0)
+        printf("%zu moves still waiting on the simulated WM\n", model.pending());
+    return 0;
+}
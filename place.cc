@@ -0,0 +1,258 @@
+#include "fling.h"
+
+/*
+ * Where windows go. Nothing here talks to the X server directly: it's all
+ * done through a DisplayBackend, so modelbench can drive it at scale.
+ */
+
+// Names for the common control strings.
+static const std::map<std::string, const char *> aliases = {
+    { "top",        "u" },
+    { "bottom",     "d" },
+    { "left",       "l" },
+    { "right",      "r" },
+    { "topleft",    "ul" },
+    { "topright",   "ur" },
+    { "bottomleft", "dl" },
+    { "bottomright", "dr" },
+};
+
+/*
+ * Compiled strings, direct-mapped by a hash of the string, so finding one is
+ * a hash and a compare, with nothing allocated. Daemons see whatever strings
+ * they're sent: a new one just takes the place of whatever was in its slot.
+ */
+constexpr size_t CACHESLOTS = 256;
+struct CacheSlot {
+    std::string location;
+    std::shared_ptr<const Location> compiled;
+};
+static CacheSlot cache[CACHESLOTS];
+
+bool
+Location::parse(const char *location)
+{
+    char curChar;
+
+    for (const char *path = location; (curChar = *path) != 0; ++path) {
+        double num = 1, denom = 2;
+        if (isdigit(curChar) || curChar == '.') {
+            char *newpath;
+            num = 1;
+            denom = strtod(path, &newpath);
+            path = newpath;
+            curChar = *path;
+            if (curChar == '/') {
+               num = denom;
+               denom = strtod(path + 1, &newpath);
+               path = newpath;
+               curChar = *path;
+            }
+        }
+        if (curChar == 'b') {
+            if (!(denom >= 0 && denom <= 0xffff))
+                return false;
+            border = denom;
+            continue;
+        }
+        // A fraction outside [0, 1] would take the window out of its space.
+        if (curChar == 0 || strchr("lrudhv", curChar) == 0 || !(denom > 0 && num >= 0 && num <= denom))
+            return false;
+        Step step;
+        step.op = curChar;
+        step.num = num;
+        step.denom = denom;
+        step.fraction = num / denom;
+        steps.push_back(step);
+    }
+    return true;
+}
+
+// Where "location" is, or would go, in the cache.
+static CacheSlot &
+slotFor(const char *location)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (const char *p = location; *p != 0; ++p)
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    return cache[hash % CACHESLOTS];
+}
+
+std::shared_ptr<const Location>
+Location::compile(const char *location)
+{
+    CacheSlot &slot = slotFor(location);
+    if (slot.compiled != 0 && slot.location == location)
+        return slot.compiled;
+
+    auto alias = aliases.find(location);
+    std::shared_ptr<Location> compiled(new Location);
+    if (!compiled->parse(alias != aliases.end() ? alias->second : location))
+        return 0;
+    // Anyone still using what was here keeps it alive.
+    slot.location = location;
+    slot.compiled = compiled;
+    return compiled;
+}
+
+/*
+ * The arithmetic is exactly what it was when we worked a character at a
+ * time, mixed double and unsigned rounding and all, so a compiled string
+ * puts windows where they always went.
+ */
+void
+Location::apply(const Geometry &usable, Geometry &geom, unsigned *windowBorder,
+      const long *frame) const
+{
+    for (auto &step : steps) {
+        switch (step.op) {
+            case 'r':
+                // move to right
+                geom.x += geom.size.width - geom.size.width * step.fraction;
+                // and then...
+            case 'l':
+                // cut out right hand side.
+                geom.size.width = geom.size.width * step.num / step.denom;
+                break;
+            case 'd':
+                geom.y += geom.size.height - geom.size.height * step.fraction;
+                // and then...
+            case 'u':
+                geom.size.height = geom.size.height * step.fraction;
+                break;
+            case 'h': {
+                // reduce horizontal size and centre
+                int newsize = geom.size.width * step.fraction;
+                geom.x += (geom.size.width - newsize) / 2;
+                geom.size.width = newsize;
+                break;
+            }
+            case 'v': {
+                // reduce vertical size and centre
+                int newsize = geom.size.height * step.fraction;
+                geom.y += (geom.size.height - newsize) / 2;
+                geom.size.height = newsize;
+                break;
+            }
+        }
+    }
+    if (border != -1)
+        *windowBorder = border;
+
+    // Keep clear of panels and docks.
+    geom = intersect(geom, usable);
+
+    /*
+     * Adjust the geometry downwards to account for the frame around the
+     * window, and our border, leaving at least a pixel of a space too small
+     * for them.
+     */
+    long width = frame[0] + frame[1] + *windowBorder * 2;
+    long height = frame[2] + frame[3] + *windowBorder * 2;
+    geom.size.width = long(geom.size.width) > width ? geom.size.width - width : 1;
+    geom.size.height = long(geom.size.height) > height ? geom.size.height - height : 1;
+    geom.x += frame[0] + *windowBorder;
+    geom.y += frame[2] + *windowBorder;
+}
+
+bool
+locate(const Geometry &usable, Geometry &geom, unsigned *border,
+      const long *frame, const char *location)
+{
+    // Use it straight from the cache if it's there, without taking a reference.
+    const CacheSlot &slot = slotFor(location);
+    if (slot.compiled != 0 && slot.location == location) {
+        slot.compiled->apply(usable, geom, border, frame);
+        return true;
+    }
+    auto compiled = Location::compile(location);
+    if (compiled == 0)
+        return false;
+    compiled->apply(usable, geom, border, frame);
+    return true;
+}
+
+/*
+ * Named layouts are built from ordinary control strings, so the windows
+ * land exactly where the equivalent one-at-a-time flings would put them.
+ */
+
+// The index'th of "count" equal slices, using "first" to keep the start of the
+// space, and "rest" to keep its end.
+static std::string
+slice(size_t index, size_t count, char first, char rest)
+{
+    std::string rv;
+    if (index != 0)
+        rv += std::to_string(count - index) + "/" + std::to_string(count) + rest;
+    return rv + "1/" + std::to_string(count - index) + first;
+}
+
+bool
+layoutLocation(const std::string &layout, size_t index, size_t count, std::string *location)
+{
+    if (layout == "columns") {
+        *location = slice(index, count, 'l', 'r');
+    } else if (layout == "rows") {
+        *location = slice(index, count, 'u', 'd');
+    } else if (layout == "grid") {
+        size_t cols = 1;
+        while (cols * cols < count)
+            ++cols;
+        size_t rows = (count + cols - 1) / cols;
+        *location = slice(index % cols, cols, 'l', 'r') + slice(index / cols, rows, 'u', 'd');
+    } else if (layout == "master") {
+        // The first window takes the left half, the rest share the right.
+        if (count == 1)
+            *location = "1/1l";
+        else if (index == 0)
+            *location = "l";
+        else
+            *location = "r" + slice(index - 1, count - 1, 'u', 'd');
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::vector<Planned>
+planPlacements(DisplayBackend &display, const std::vector<Placement> &placements,
+      int screen, unsigned border)
+{
+    std::vector<Planned> plans;
+    if (placements.empty())
+        return plans;
+
+    // Find out everything we need about all the windows in one go.
+    display.phase("frame");
+    std::vector<Window> windows;
+    for (auto &p : placements)
+        windows.push_back(p.win);
+    std::vector<WindowInfo> infos;
+    display.describeWindows(windows, infos);
+    // The first window's monitor, from what we just found out, for those not given one.
+    if (screen == -1)
+        screen = infos[0].exists ? display.monitorAt(infos[0].geom) : 0;
+
+    display.phase("struts");
+    for (size_t i = 0; i < placements.size(); ++i) {
+        const Placement &p = placements[i];
+        const WindowInfo &info = infos[i];
+        if (!info.exists) {
+            std::cerr << "window " << p.win << " has gone away" << std::endl;
+            continue;
+        }
+        Planned plan;
+        plan.index = i;
+        plan.win = p.win;
+        plan.screen = p.screen == -1 ? screen : p.screen;
+        plan.from = info.geom;
+        const Geometry &usable = display.usableArea(info.desktop, plan.screen);
+        plan.to = usable;
+        unsigned windowBorder = border;
+        if (!locate(usable, plan.to, &windowBorder, info.frame, p.location.c_str()))
+            throw "invalid control string";
+        plans.push_back(plan);
+    }
+    return plans;
+}
@@ -0,0 +1,186 @@
+#include "fling.h"
+#include "shared.h"
+#include <X11/Xatom.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * The publisher side of shared.h: keep a SharedState up to date with what
+ * one-shot flings would otherwise ask the X server for each time.
+ */
+
+// Changes come in bursts: wait this long after the first before publishing.
+constexpr long COALESCE = 10 * 1000 * 1000; // nanoseconds
+
+Publisher::Publisher(X11Env &x11_)
+    : x11(x11_)
+    , name(sharedName(DisplayString(x11_.display)))
+    , monitorChanges(x11_.monitorChanges)
+    , due(0)
+{
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1)
+        throw "can't create shared memory";
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, sizeof (SharedState)) == 0)
+        map = mmap(0, sizeof (SharedState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        throw "can't map shared memory";
+    }
+    state = (SharedState *)map;
+
+    // Readers won't trust it until it's filled in, and we're known to be watching.
+    __atomic_store_n(&state->dirty, 1, __ATOMIC_RELEASE);
+    state->magic = SHARED_MAGIC;
+    state->version = SHARED_VERSION;
+    state->publisher = getpid();
+    state->root = x11.root;
+    x11.shareAtoms(*state);
+    x11.selectInput(x11.root, PropertyChangeMask);
+    publish();
+}
+
+Publisher::~Publisher()
+{
+    // Anyone who still has it mapped can see we're gone from "publisher".
+    __atomic_store_n(&state->dirty, 1, __ATOMIC_RELEASE);
+    munmap(state, sizeof (SharedState));
+    shm_unlink(name.c_str());
+}
+
+void
+Publisher::handleEvent(const XEvent &event)
+{
+    switch (event.type) {
+        case PropertyNotify: {
+            // Only the properties we publish: not WM_NAME, _NET_WM_USER_TIME, etc.
+            Atom atom = event.xproperty.atom;
+            if (event.xproperty.window == x11.root
+                    ? atom != x11.NetActiveWindow && atom != x11.NetClientList
+                        && atom != x11.NetCurrentDesktop && atom != x11.NetWorkarea
+                    : atom != x11.NetFrameExtents && atom != x11.NetWmDesktop
+                        && atom != x11.NetWmPid && atom != x11.NetWmState
+                        && atom != x11.NetWmStrutPartial && atom != x11.NetWmStrut)
+                return;
+            break;
+        }
+        case ConfigureNotify:
+        case MapNotify:
+        case UnmapNotify:
+        case DestroyNotify:
+            break;
+        default:
+            if (x11.monitorChanges == monitorChanges)
+                return;
+            monitorChanges = x11.monitorChanges;
+            break;
+    }
+    if (due != 0)
+        return;
+    // Readers ask the server until we've caught up.
+    __atomic_store_n(&state->dirty, 1, __ATOMIC_RELEASE);
+    due = nsecNow() + COALESCE;
+}
+
+int
+Publisher::timeout() const
+{
+    if (due == 0)
+        return -1;
+    long left = due - nsecNow();
+    return left <= 0 ? 0 : int((left + 999999) / 1000000);
+}
+
+void
+Publisher::publish()
+{
+    Span span(x11, "publish");
+    due = 0;
+
+    std::vector<long> active, clients, workarea;
+    long currentDesktop = -1;
+    {
+        PropertyBatch root(x11, "root batch");
+        auto activeTicket = root.request(x11.root, x11.NetActiveWindow, x11.AWindow);
+        auto clientsTicket = root.request(x11.root, x11.NetClientList, x11.AWindow, 1 << 20);
+        auto currentTicket = root.request(x11.root, x11.NetCurrentDesktop, x11.Cardinal);
+        auto workareaTicket = root.request(x11.root, x11.NetWorkarea, x11.Cardinal);
+        root.cardinals(activeTicket, active);
+        root.cardinals(clientsTicket, clients);
+        root.cardinals(currentTicket, &currentDesktop, 1);
+        root.cardinals(workareaTicket, workarea);
+    }
+    auto &monitors = x11.getMonitors();
+    // Every glide wants these, and they take a round trip per CRTC to find.
+    std::vector<double> rates;
+    for (size_t i = 0; i < monitors.size(); ++i)
+        rates.push_back(x11.refreshRate(i));
+
+    size_t count = std::min(clients.size(), SHARED_CLIENTS);
+    enum { FRAME, DESKTOP, PID, STATE, PARTIAL, LEGACY, REQUESTS };
+    PropertyBatch props(x11, "client batch");
+    GeometryBatch geoms(x11);
+    for (size_t i = 0; i < count; ++i) {
+        Window win = clients[i];
+        props.request(win, x11.NetFrameExtents, x11.Cardinal);
+        props.request(win, x11.NetWmDesktop, x11.Cardinal);
+        props.request(win, x11.NetWmPid, x11.Cardinal);
+        props.request(win, x11.NetWmState, XA_ATOM);
+        props.request(win, x11.NetWmStrutPartial, x11.Cardinal);
+        props.request(win, x11.NetWmStrut, x11.Cardinal);
+        geoms.request(win);
+        // Hear about it moving, or its properties changing, from now on.
+        x11.selectInput(win, PropertyChangeMask | StructureNotifyMask);
+    }
+    std::vector<SharedClient> described;
+    described.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        SharedClient client;
+        memset(&client, 0, sizeof client);
+        client.win = clients[i];
+        if (!geoms.geometry(i, &client.geom))
+            continue; // gone since the WM listed it.
+        props.cardinals(i * REQUESTS + FRAME, client.frame, 4);
+        client.desktop = -1;
+        props.cardinals(i * REQUESTS + DESKTOP, &client.desktop, 1);
+        props.cardinals(i * REQUESTS + PID, &client.pid, 1);
+        std::vector<long> atoms;
+        props.cardinals(i * REQUESTS + STATE, atoms);
+        client.state = x11.stateFlags(atoms);
+        long values[12];
+        PartialStrut *strut = (PartialStrut *)values;
+        if (props.cardinals(i * REQUESTS + PARTIAL, values, 12)) {
+            client.hasStrut = 1;
+        } else if (props.cardinals(i * REQUESTS + LEGACY, values, 4)) {
+            // As readStruts: a legacy strut reserves its edge along the entire screen.
+            strut->rleft.start = strut->rright.start = 0;
+            strut->rleft.end = strut->rright.end = x11.rootGeom.size.height - 1;
+            strut->rtop.start = strut->rbottom.start = 0;
+            strut->rtop.end = strut->rbottom.end = x11.rootGeom.size.width - 1;
+            client.hasStrut = 1;
+        }
+        if (client.hasStrut)
+            client.strut = *strut;
+        described.push_back(client);
+    }
+
+    // Make the sequence odd while we write, so readers know to try again.
+    uint32_t sequence = state->sequence;
+    __atomic_store_n(&state->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    state->active = active.empty() ? 0 : active[0];
+    state->monitorCount = std::min(monitors.size(), SHARED_MONITORS);
+    std::copy(monitors.begin(), monitors.begin() + state->monitorCount, state->monitors);
+    std::copy(rates.begin(), rates.begin() + state->monitorCount, state->refreshRates);
+    state->currentDesktop = currentDesktop;
+    state->workareaCount = std::min(workarea.size(), SHARED_DESKTOPS * 4);
+    std::copy(workarea.begin(), workarea.begin() + state->workareaCount, state->workarea);
+    // Too many clients to share: readers see a count they won't accept.
+    state->clientCount = clients.size() > SHARED_CLIENTS ? clients.size() : described.size();
+    std::copy(described.begin(), described.end(), state->clients);
+    __atomic_store_n(&state->sequence, sequence + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&state->dirty, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,38 @@
+#include "fling.h"
+#include <regex.h>
+#include <strings.h>
+
+bool
+Selector::empty() const
+{
+    return wmClass == 0 && title == 0 && !byDesktop && monitor == -1 && workdir == 0;
+}
+
+std::vector<ClientInfo>
+selectWindows(X11Env &x11, const Selector &selector)
+{
+    regex_t title;
+    if (selector.title != 0 && regcomp(&title, selector.title, REG_EXTENDED | REG_NOSUB) != 0)
+        throw "invalid title pattern";
+
+    std::vector<ClientInfo> clients, matches;
+    x11.indexClients(clients);
+    for (auto &client : clients) {
+        if (selector.wmClass != 0 && strcasecmp(client.wmClass.c_str(), selector.wmClass) != 0
+                && strcasecmp(client.instance.c_str(), selector.wmClass) != 0)
+            continue;
+        if (selector.title != 0 && regexec(&title, client.title.c_str(), 0, 0, 0) != 0)
+            continue;
+        // Windows on all desktops are on the one we're after too.
+        if (selector.byDesktop && client.desktop != selector.desktop && client.desktop != -1)
+            continue;
+        if (selector.monitor != -1 && x11.monitorAt(client.geom) != selector.monitor)
+            continue;
+        if (selector.workdir != 0 && client.workdir != selector.workdir)
+            continue;
+        matches.push_back(client);
+    }
+    if (selector.title != 0)
+        regfree(&title);
+    return matches;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include "wmhack.h"
+
+/*
+ * What a publisher (fling --publish) keeps in shared memory for one-shot
+ * flings, so they can work out where a window goes without asking the X
+ * server. It's a seqlock: the publisher makes "sequence" odd while it
+ * writes, and even again when it's done, and readers copy the state out,
+ * trying again if "sequence" changed under them.
+ */
+constexpr uint32_t SHARED_MAGIC = 0x464c4e47; // "FLNG"
+constexpr uint32_t SHARED_VERSION = 2;
+constexpr size_t SHARED_ATOMS = 64;
+constexpr size_t SHARED_MONITORS = 32;
+constexpr size_t SHARED_DESKTOPS = 32;
+constexpr size_t SHARED_CLIENTS = 2048;
+
+struct SharedState {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sequence;
+    uint32_t dirty; // the publisher has seen changes it hasn't published yet.
+    pid_t publisher;
+    Window root;
+    uint64_t atomNames; // hash of the atom names, so we know "atoms" are in our order.
+    Atom atoms[SHARED_ATOMS];
+    Window active;
+    uint32_t monitorCount;
+    Geometry monitors[SHARED_MONITORS];
+    double refreshRates[SHARED_MONITORS]; // Hz, as X11Env::refreshRate() finds them.
+    long currentDesktop;
+    uint32_t workareaCount;
+    long workarea[SHARED_DESKTOPS * 4];
+    uint32_t clientCount; // more than SHARED_CLIENTS if they didn't all fit.
+    SharedClient clients[SHARED_CLIENTS]; // in _NET_CLIENT_LIST order.
+};
+
+// The name of the shared memory for a display.
+std::string sharedName(const char *display);
@@ -0,0 +1,263 @@
+#include "fling.h"
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <X11/Xatom.h>
+
+/*
+ * A layout file is a header, a fixed-size record for each window, and then
+ * the strings the records refer to, each nul-terminated. Everything is
+ * aligned for its type, so a restore can use the file where it's mapped.
+ */
+static const char MAGIC[8] = { 'F', 'L', 'N', 'G', 'L', 'A', 'Y', 'T' };
+constexpr uint32_t VERSION = 1;
+
+struct LayoutHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count; // of records.
+    uint32_t stringsSize; // bytes of strings after the records.
+    uint32_t pad;
+};
+
+struct LayoutRecord {
+    uint64_t identity; // hash of class, instance and workdir: the index key.
+    uint64_t titleHash; // to tell apart windows with the same identity.
+    uint32_t wmClass; // offsets into the strings.
+    uint32_t instance;
+    uint32_t workdir;
+    int32_t monitor;
+    int32_t x; // relative to the monitor.
+    int32_t y;
+    uint32_t width;
+    uint32_t height;
+    int32_t desktop;
+    uint32_t opacity;
+    uint32_t state; // StateFlag bits.
+    uint32_t pad;
+};
+
+// The _NET_WM_STATE flags we save, as bits, since atoms vary from server to server.
+static const struct {
+    Atom X11Env::*atom;
+    uint32_t bit;
+} stateFlags[] = {
+    { &X11Env::NetWmStateFullscreen, 1 },
+    { &X11Env::NetWmStateMaximizedHoriz, 2 },
+    { &X11Env::NetWmStateMaximizedVert, 4 },
+    { &X11Env::NetWmStateAbove, 8 },
+    { &X11Env::NetWmStateBelow, 16 },
+    { &X11Env::NetWmStateShaded, 32 },
+};
+
+// FNV-1a
+static uint64_t
+hash(const std::string &s, uint64_t h = 14695981039346656037ULL)
+{
+    for (unsigned char c : s)
+        h = (h ^ c) * 1099511628211ULL;
+    return h;
+}
+
+static uint64_t
+identity(const std::string &wmClass, const std::string &instance, const std::string &workdir)
+{
+    // Hash the terminating nuls too, so "ab" + "c" differs from "a" + "bc"
+    return hash(workdir + '\0', hash(instance + '\0', hash(wmClass + '\0')));
+}
+
+static uint32_t
+stateBits(const X11Env &x11, const std::vector<long> &state)
+{
+    uint32_t bits = 0;
+    for (auto atom : state)
+        for (auto &flag : stateFlags)
+            if (Atom(atom) == x11.*flag.atom)
+                bits |= flag.bit;
+    return bits;
+}
+
+// Change the states in "bits", maximizing (or not) both ways in one message if it's both.
+static void
+changeStates(const X11Env &x11, Transaction &changes, Window win, uint32_t bits,
+      X11Env::StateUpdateAction action)
+{
+    constexpr uint32_t maximized = 2 | 4;
+    if ((bits & maximized) == maximized) {
+        changes.state(win, x11.NetWmStateMaximizedHoriz, action, x11.NetWmStateMaximizedVert);
+        bits &= ~maximized;
+    }
+    for (auto &flag : stateFlags)
+        if (bits & flag.bit)
+            changes.state(win, x11.*flag.atom, action);
+}
+
+void
+saveLayout(X11Env &x11, const char *path, const std::vector<ClientInfo> &clients)
+{
+    std::vector<LayoutRecord> records;
+    std::string strings;
+    std::map<std::string, uint32_t> offsets;
+    auto intern = [&](const std::string &s) {
+        auto it = offsets.find(s);
+        if (it != offsets.end())
+            return it->second;
+        uint32_t offset = strings.size();
+        strings.append(s.c_str(), s.size() + 1);
+        offsets[s] = offset;
+        return offset;
+    };
+
+    auto &monitors = x11.getMonitors();
+    for (auto &client : clients) {
+        LayoutRecord r;
+        memset(&r, 0, sizeof r);
+        r.identity = identity(client.wmClass, client.instance, client.workdir);
+        r.titleHash = hash(client.title);
+        r.wmClass = intern(client.wmClass);
+        r.instance = intern(client.instance);
+        r.workdir = intern(client.workdir);
+        r.monitor = x11.monitorAt(client.geom);
+        r.x = client.geom.x - monitors[r.monitor].x;
+        r.y = client.geom.y - monitors[r.monitor].y;
+        r.width = client.geom.size.width;
+        r.height = client.geom.size.height;
+        r.desktop = client.desktop;
+        r.opacity = client.opacity * std::numeric_limits<uint32_t>::max();
+        r.state = stateBits(x11, client.state);
+        records.push_back(r);
+    }
+
+    LayoutHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, MAGIC, sizeof MAGIC);
+    header.version = VERSION;
+    header.count = records.size();
+    header.stringsSize = strings.size();
+
+    // Write a new file, and rename it into place, so a crash can't leave half a layout.
+    std::string temp = std::string(path) + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        out.write((const char *)&header, sizeof header);
+        out.write((const char *)records.data(), records.size() * sizeof records[0]);
+        out.write(strings.data(), strings.size());
+        if (!out)
+            throw "can't write layout file";
+    }
+    if (rename(temp.c_str(), path) == -1)
+        throw "can't write layout file";
+    std::clog << "saved " << records.size() << " windows to " << path << std::endl;
+}
+
+// A layout file, mapped.
+class LayoutFile {
+    void *base;
+    size_t size;
+public:
+    const LayoutHeader *header;
+    const LayoutRecord *records;
+    const char *strings;
+    LayoutFile(const char *path);
+    ~LayoutFile() { munmap(base, size); }
+    const char *string(uint32_t offset) const { return strings + offset; }
+};
+
+LayoutFile::LayoutFile(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        throw "can't open layout file";
+    struct stat st;
+    if (fstat(fd, &st) == -1 || size_t(st.st_size) < sizeof *header) {
+        close(fd);
+        throw "not a layout file";
+    }
+    size = st.st_size;
+    base = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        throw "can't map layout file";
+    header = (const LayoutHeader *)base;
+    records = (const LayoutRecord *)(header + 1);
+    strings = (const char *)(records + header->count);
+    // Check the strings are all inside the file, and terminated.
+    bool ok = memcmp(header->magic, MAGIC, sizeof MAGIC) == 0
+        && header->version == VERSION
+        && size == sizeof *header + header->count * sizeof *records + header->stringsSize
+        && (header->stringsSize == 0 || strings[header->stringsSize - 1] == 0);
+    for (size_t i = 0; ok && i < header->count; ++i)
+        ok = records[i].wmClass < header->stringsSize
+            && records[i].instance < header->stringsSize
+            && records[i].workdir < header->stringsSize;
+    if (!ok) {
+        munmap(base, size);
+        throw "not a layout file";
+    }
+}
+
+/*
+ * Put each window back as the layout file has it. Windows are matched to
+ * records by class, instance and workdir, preferring the record with the
+ * same title if several match. Every change for every window goes out
+ * before we wait for any of them, so this costs the same round trips for a
+ * thousand windows as for one.
+ */
+size_t
+restoreLayout(X11Env &x11, const char *path, const std::vector<ClientInfo> &clients)
+{
+    LayoutFile layout(path);
+    std::unordered_multimap<uint64_t, size_t> index;
+    for (size_t i = 0; i < layout.header->count; ++i)
+        index.insert(std::make_pair(layout.records[i].identity, i));
+
+    auto &monitors = x11.getMonitors();
+    std::vector<bool> used(layout.header->count);
+    size_t restored = 0;
+    Transaction changes(x11);
+    for (auto &client : clients) {
+        const LayoutRecord *match = 0;
+        auto range = index.equal_range(identity(client.wmClass, client.instance, client.workdir));
+        uint64_t title = hash(client.title);
+        for (auto it = range.first; it != range.second; ++it) {
+            const LayoutRecord &r = layout.records[it->second];
+            if (used[it->second] || client.wmClass != layout.string(r.wmClass)
+                    || client.instance != layout.string(r.instance)
+                    || client.workdir != layout.string(r.workdir))
+                continue;
+            if (match == 0 || (r.titleHash == title && match->titleHash != title))
+                match = &r;
+        }
+        if (match == 0)
+            continue;
+        used[match - layout.records] = true;
+        ++restored;
+
+        // Take off the states it shouldn't have first, so they don't override its geometry.
+        uint32_t current = stateBits(x11, client.state);
+        changeStates(x11, changes, client.win, current & ~match->state, X11Env::REMOVE);
+        if (match->desktop != client.desktop)
+            changes.desktop(client.win, match->desktop);
+        uint32_t opacity = client.opacity * std::numeric_limits<uint32_t>::max();
+        if (match->opacity != opacity) {
+            unsigned long value = match->opacity;
+            changes.property(client.win, x11.NetWmOpacity, XA_CARDINAL, 32, &value, 1);
+        }
+        // If its monitor has gone, put it on the first.
+        const Geometry &monitor = size_t(match->monitor) < monitors.size()
+            ? monitors[match->monitor] : monitors[0];
+        Geometry geom;
+        geom.x = monitor.x + match->x;
+        geom.y = monitor.y + match->y;
+        geom.size.width = match->width;
+        geom.size.height = match->height;
+        changes.geometry(client.win, geom);
+        changeStates(x11, changes, client.win, match->state & ~current, X11Env::ADD);
+    }
+    changes.commit(true);
+    std::clog << "restored " << restored << " of " << layout.header->count
+        << " windows from " << path << std::endl;
+    return restored;
+}
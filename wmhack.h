@@ -1,8 +1,10 @@
+#pragma once
 #include <iostream>
 #include <unistd.h>
 #include <X11/cursorfont.h>
 #include <limits>
 #include <list>
+#include <map>
 #include <vector>
 #include <string.h>
 #include <assert.h>
@@ -10,11 +12,13 @@
 #include <stdlib.h>
 #include <X11/X.h>
 #include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xmd.h>
 #include <X11/extensions/Xinerama.h>
 #include <X11/Xmu/WinUtil.h>
 
 struct X11Env;
+struct SharedState;
 
 struct Size {
     unsigned width;
@@ -27,6 +31,7 @@ struct Geometry {
     int y;
 };
 extern std::ostream & operator<<(std::ostream &os, const Geometry &m);
+extern Geometry intersect(const Geometry &a, const Geometry &b);
 
 struct Range {
     long start;
@@ -46,51 +51,380 @@ struct PartialStrut {
     Range rright;
     Range rtop;
     Range rbottom;
-    void box(const X11Env &x11, Geometry &g);
+    void box(const Geometry &root, Geometry &g); // clip g, on a screen of size root.
 };
 extern std::ostream & operator<<(std::ostream &os, const PartialStrut &m);
 
-struct X11Env {
+// The root window properties that decide how strut processing goes.
+struct DesktopInfo {
+    std::vector<long> workarea; // _NET_WORKAREA, 4 values per desktop.
+    long currentDesktop = 0;
+    std::vector<Window> clients;
+};
+
+// A client that reserves space at the edges of the screen.
+struct ClientStruts {
+    long desktop; // -1 if on all desktops.
+    PartialStrut strut; // legacy struts are converted to cover their whole edge.
+};
+
+// What selecting a window by its properties needs to know about it.
+struct ClientInfo {
+    Window win;
+    std::string instance; // the two parts of WM_CLASS.
+    std::string wmClass;
+    std::string title; // _NET_WM_NAME, or WM_NAME.
+    std::string workdir; // _PME_WORKDIR
+    long desktop; // -1 if on all desktops, or not known.
+    double opacity; // 0 to 1.
+    std::vector<long> state; // _NET_WM_STATE atoms.
+    Geometry geom; // relative to the root.
+};
+
+// What placing a window needs to know about it.
+struct WindowInfo {
+    bool exists;
+    Geometry geom; // relative to the root.
+    long frame[4]; // _NET_FRAME_EXTENTS, or zeros.
+    long desktop; // -1 if not known.
+};
+
+// The _NET_WM_STATE flags we care about, as bits.
+enum SharedStateFlag {
+    SHARED_SHADED = 1,
+    SHARED_MAXIMIZED_HORZ = 2,
+    SHARED_FULLSCREEN = 4,
+};
+
+/*
+ * Everything a fling needs to know about a client, as a publisher shares it
+ * (see shared.h), or a daemon prefetches it for the active window.
+ */
+struct SharedClient {
+    Window win;
+    Geometry geom; // relative to the root.
+    long frame[4]; // _NET_FRAME_EXTENTS, or zeros.
+    long desktop; // -1 if on all desktops, or not known.
+    long pid; // _NET_WM_PID, or 0.
+    uint32_t state; // SharedStateFlag bits.
+    uint32_t hasStrut;
+    PartialStrut strut; // legacy struts converted, as readStruts does.
+};
+
+/*
+ * The display operations the geometry logic depends on. X11Env does them
+ * against the X server, and DisplayModel (in model.h) against an in-memory
+ * model, so the logic can be profiled at scale without one. Everything
+ * built on them (monitors, usable areas, placing windows) lives here, or
+ * takes a DisplayBackend.
+ */
+class DisplayBackend {
+public:
+    Geometry rootGeom;
+    std::vector<Geometry> monitors; // empty until getMonitors() is first called.
+    std::map<long, std::vector<Geometry>> usableAreas; // per-monitor, by desktop.
+
+    virtual ~DisplayBackend() {}
+    virtual void detectMonitors() = 0; // Get the geometry of the monitors.
+    virtual void readDesktops(DesktopInfo &) = 0;
+    // The struts of those of "clients" that have them.
+    virtual void readStruts(const std::vector<Window> &clients, std::vector<ClientStruts> &) = 0;
+    // Describe all of "windows", in one go if we can.
+    virtual void describeWindows(const std::vector<Window> &windows, std::vector<WindowInfo> &) = 0;
+    virtual int monitorForWindow(Window) = 0; // find index of monitor on which a window lies.
+    virtual void sendGeometry(Window win, const Geometry &geom) const = 0; // no XSync
+    virtual void phase(const char *) {} // start a phase of a command, for instrumentation.
+
+    const std::vector<Geometry> &getMonitors(); // detect monitors on first use.
+    /*
+     * The part of a monitor not reserved by panels or docks on a desktop.
+     * Worked out for all monitors when first asked for, and cached.
+     */
+    const Geometry &usableArea(long desktop, int monitor);
+    std::vector<Geometry> findUsableAreas(long desktop);
+    int monitorAt(const Geometry &); // find index of monitor containing the centre of the geometry.
+};
+
+struct X11Env : public DisplayBackend {
     Display *display;
     Window root;
-    Geometry rootGeom;
-    std::vector<Geometry> monitors;
-
-    X11Env(Display *display_);
-    Atom atom(const char *name) { return XInternAtom(display, name, False); }
-    Atom NetCurrentDesktop = atom("_NET_CURRENT_DESKTOP");
-    Atom NetActiveWindow = atom("_NET_ACTIVE_WINDOW");
-    Atom NetDesktopNames = atom("_NET_DESKTOP_NAMES");
-    Atom AWindow = atom("WINDOW");
-    Atom Cardinal = atom("CARDINAL");
-    Atom VisualId = atom("VISUALID");
-    Atom NetMoveResizeWindow = atom("_NET_MOVERESIZE_WINDOW");
-    Atom NetFrameExtents = atom("_NET_FRAME_EXTENTS");
-    Atom NetClientList = atom("_NET_CLIENT_LIST");
-    Atom NetWmStrut = atom("_NET_WM_STRUT");
-    Atom NetWmStrutPartial = atom("_NET_WM_STRUT_PARTIAL");
-    Atom NetWmStateFullscreen = atom("_NET_WM_STATE_FULLSCREEN");
-    Atom NetWmStateBelow = atom("_NET_WM_STATE_BELOW");
-    Atom NetWmStateAbove = atom("_NET_WM_STATE_ABOVE");
-    Atom NetWmState = atom("_NET_WM_STATE");
-    Atom NetWmDesktop = atom("_NET_WM_DESKTOP");
-    Atom NetWmStateAdd = atom("_NET_WM_STATE_ADD");
-    Atom NetWmStateMaximizedVert = atom("_NET_WM_STATE_MAXIMIZED_VERT");
-    Atom NetWmStateMaximizedHoriz = atom("_NET_WM_STATE_MAXIMIZED_HORZ");
-    Atom NetWmStateShaded = atom("_NET_WM_STATE_SHADED");
-    Atom NetWmOpacity = atom("_NET_WM_WINDOW_OPACITY");
-    Atom WorkDir = atom("_PME_WORKDIR");
-
-    void detectMonitors(); // Get the geometry of the monitors.
+
+    /*
+     * With "useShared", use the state a publisher keeps in shared memory,
+     * if there is one, and it's current, rather than asking the server.
+     */
+    X11Env(Display *display_, bool useShared = false);
+
+    /*
+     * Atoms we use, all interned with a single request when the environment
+     * is created. See atomNames in common.cc.
+     */
+    Atom NetCurrentDesktop,
+        NetActiveWindow,
+        NetDesktopNames,
+        AWindow,
+        Cardinal,
+        VisualId,
+        NetMoveResizeWindow,
+        NetFrameExtents,
+        NetClientList,
+        NetWmStrut,
+        NetWmStrutPartial,
+        NetWmStateFullscreen,
+        NetWmStateBelow,
+        NetWmStateAbove,
+        NetWmState,
+        NetWmDesktop,
+        NetWmStateAdd,
+        NetWmStateMaximizedVert,
+        NetWmStateMaximizedHoriz,
+        NetWmStateShaded,
+        NetWmOpacity,
+        NetWmPid,
+        NetWorkarea,
+        NetWmSyncRequest,
+        NetWmSyncRequestCounter,
+        WmProtocols,
+        WorkDir,
+        NetWmName,
+        Utf8String,
+        NetSupported;
+
+    // Number of requests made that waited on a reply from the server.
+    mutable unsigned long roundTrips = 0;
+
+    /*
+     * Instrumentation: a command is divided into phases, each accounting for
+     * the requests it sent, the round trips it made (see RoundTrip), and the
+     * time it spent waiting on them. With "instrument" set, we also count
+     * the bytes the process reads and writes, which is mostly X traffic.
+     */
+    struct Phase {
+        const char *name;
+        unsigned long requests = 0;
+        unsigned long roundTrips = 0;
+        long waitNs = 0;
+        long elapsedNs = 0;
+        long long bytesOut = -1; // -1 if we weren't counting bytes.
+        long long bytesIn = -1;
+        unsigned long firstRequest; // where we were at the start of the phase.
+        long started;
+        long long readStart, writeStart;
+    };
+    mutable std::vector<Phase> phases;
+    bool inPhase = false;
+    bool instrument = false; // count bytes: set by FLING_STATS, or -v.
+    std::string stats; // FLING_STATS: "json" reports the phases as JSON.
+    mutable int waitDepth = 0; // nested RoundTrips only count the outermost's time.
+    mutable long waitStarted;
+    void phase(const char *name); // end the current phase, and start another.
+    void endPhase();
+    // Start accounting for a new command, with its FLING_STATS and FLING_TRACE (0 if unset).
+    void resetStats(const char *stats, const char *tracePath);
+    void reportPhases(std::ostream &, bool json) const;
+
+    /*
+     * Timeline tracing, turned on by setting FLING_TRACE to a file name:
+     * phases, Spans and glide frames are recorded, and writeTrace() saves
+     * them there as Chrome trace-event JSON, for Perfetto or about:tracing.
+     */
+    struct TraceEvent {
+        std::string name;
+        char type; // 'X' for a span, 'i' for an instant.
+        long start; // nanoseconds, CLOCK_MONOTONIC
+        long duration;
+        std::string args; // JSON object, or empty.
+    };
+    std::string tracePath; // empty unless we're tracing.
+    mutable std::vector<TraceEvent> traceEvents;
+    void trace(const std::string &name, long start, long end, const std::string &args = "") const;
+    void traceInstant(const std::string &name, long when, const std::string &args = "") const;
+    void writeTrace() const;
+
+    // How long the WM has recently taken to act on a move, in nanoseconds, or -1.
+    long wmLatency = -1;
+
+    // Event base for the XSync extension: 0 until syncExtension() finds it.
+    int syncEventBase = 0;
+    bool syncChecked = false;
+    bool syncExtension(); // can we use the XSync extension?
+
+    // Event base for RandR: 0 until watchMonitors() finds it.
+    int randrEventBase = 0;
+    unsigned long monitorChanges = 0; // bumped each time handleEvent sees the monitors change.
+    void watchMonitors(); // hear from RandR when monitors come and go.
+    void detectMonitors();
+    void readDesktops(DesktopInfo &);
+    void readStruts(const std::vector<Window> &clients, std::vector<ClientStruts> &);
+    void describeWindows(const std::vector<Window> &windows, std::vector<WindowInfo> &);
+    // Describe every client the WM lists, from one pipelined sweep of requests.
+    void indexClients(std::vector<ClientInfo> &);
+    void selectInput(Window win, long mask); // add to the events we hear about on a window.
+    std::map<Window, long> eventMasks;
+    void handleEvent(const XEvent &); // keep caches current in a long-lived process.
+
+    // A resident fling remembers where it flung windows, to put them back when monitors change.
+    struct Placed {
+        std::string location; // control string the window was last flung with...
+        int screen; // ... onto this monitor...
+        Geometry monitor; // ... which was here.
+    };
+    std::map<Window, Placed> placed; // forgotten when the window is destroyed.
+
+    // Our copy of a publisher's state, if we're using one. See shared.h.
+    const SharedState *shared = 0;
+    std::vector<char> sharedCopy;
+    std::map<Window, const SharedClient *> sharedClients;
+    bool readShared();
+    const SharedClient *sharedClient(Window) const; // 0 if we don't know about it.
+    void shareAtoms(SharedState &) const; // for a publisher.
+    bool mayHaveState(Window, Atom) const; // false only if we know it doesn't.
+    uint32_t stateFlags(const std::vector<long> &atoms) const; // _NET_WM_STATE as SharedStateFlag bits.
+
+    /*
+     * A resident fling fetches what it needs to know about the active window
+     * when the focus moves to it, rather than when asked to fling it, and
+     * keeps it current from the window's events. sharedClient() finds it.
+     */
+    bool prefetching = false;
+    bool prefetchStale = true; // fetch it again before using it.
+    SharedClient prefetched;
+    void watchActive(); // start prefetching.
+    bool prefetch(); // fetch the active window's state if stale, and say if we did: call when idle.
+    void catchUp(); // handle events that affect what we've prefetched.
 
     Geometry getGeometry(Window w) const;
     Geometry getGeometry(Window w, Window *root) const;
-    void setGeometry(Window win, const Geometry &geom) const;
+    void sendGeometry(Window win, const Geometry &geom) const; // no XSync
     Window pick(); // pick a window on the display using the mouse.
-    Window active(); // find active window
+    /*
+     * Find the active window. If it belongs to the process that ran us or one
+     * of its ancestors (eg, a launcher like gmrun), or is still changing, wait
+     * up to maxWait milliseconds for the focus to settle.
+     */
+    Window active(pid_t requester, int maxWait);
+    Window activeWindow() const; // _NET_ACTIVE_WINDOW as it is right now.
+    bool focusPending(Window, pid_t requester) const;
     enum StateUpdateAction { REMOVE = 0, ADD = 1, TOGGLE = 2 };
-    void updateState(Window win, const Atom toggle, StateUpdateAction update) const;
-    int monitorForWindow(Window); // find index of monitor on which a window lies.
+    // The send*() calls send at once, without XSync: see Transaction to batch them.
+    // Change "toggle", and "second" with it if not None, as one message. No XSync.
+    void sendState(Window win, const Atom toggle, StateUpdateAction update, Atom second = None) const;
+    void sendDesktop(Window win, long desktop) const; // move to a desktop; no XSync
+    int monitorForWindow(Window);
+    std::vector<double> refreshRates; // by monitor, empty until refreshRate() is first called.
+    double refreshRate(int monitor); // vertical refresh in Hz, from RandR.
     long desktopForWindow(Window) const; // what desktop is a window on? returns -1 if no desktops.
+    // XGetWindowProperty, accounting for the round trip.
+    int getProperty(Window win, Atom property, Atom type, int *actualFormat,
+          unsigned long *itemCount, unsigned char **prop,
+          long length = std::numeric_limits<long>::max()) const;
     operator Display *() const { return display; }
 };
+
+/*
+ * Declare one of these alongside a request that waits for the server: it
+ * counts "count" round trips, and the time until it goes out of scope as
+ * time spent waiting on the server.
+ */
+class RoundTrip {
+    const X11Env &x11;
+public:
+    RoundTrip(const X11Env &x11, unsigned long count = 1);
+    ~RoundTrip();
+};
+
+/*
+ * Records the time from its construction to its destruction as a span in
+ * the trace, if we're tracing.
+ */
+class Span {
+    const X11Env &x11;
+    const char *name;
+    long start;
+public:
+    Span(const X11Env &x11, const char *name);
+    ~Span();
+};
+
+// CLOCK_MONOTONIC, in nanoseconds.
+long nsecNow();
+
+/*
+ * Property reads sent to the server all at once, with the replies collected
+ * afterwards, so a batch costs one round trip of latency however many
+ * requests it holds. Requests go out over the XCB connection underlying
+ * the Xlib display.
+ */
+class PropertyBatch {
+    const X11Env &x11;
+    Span span;
+    xcb_connection_t *conn;
+    std::vector<xcb_get_property_cookie_t> cookies;
+    std::vector<bool> collected;
+    bool waited;
+    xcb_get_property_reply_t *reply(size_t ticket);
+public:
+    PropertyBatch(const X11Env &x11, const char *name = "property batch");
+    ~PropertyBatch();
+    // Queue a read, returning a ticket to collect the reply with.
+    size_t request(Window win, Atom property, Atom type, uint32_t length = 1024);
+    /*
+     * Collect a format-32 property holding exactly "count" items into "values",
+     * sign-extended as Xlib does. Returns false if it's missing or malformed.
+     */
+    bool cardinals(size_t ticket, long *values, size_t count);
+    // As above, for a property of any length.
+    bool cardinals(size_t ticket, std::vector<long> &values);
+    // Collect a format-8 property, such as a string, into "value".
+    bool text(size_t ticket, std::string &value);
+};
+
+/*
+ * As PropertyBatch, for the geometries of windows relative to the root.
+ */
+class GeometryBatch {
+    const X11Env &x11;
+    Span span;
+    xcb_connection_t *conn;
+    std::vector<xcb_get_geometry_cookie_t> sizes;
+    std::vector<xcb_translate_coordinates_cookie_t> origins;
+    std::vector<bool> collected;
+    bool waited;
+public:
+    GeometryBatch(const X11Env &x11, const char *name = "geometry batch");
+    ~GeometryBatch();
+    size_t request(Window win);
+    bool geometry(size_t ticket, Geometry *geom); // false if the window's gone.
+};
+
+/*
+ * The write side: changes to windows are held back until commit() sends
+ * them all, in the order they were made, in a single write to the server,
+ * waiting for it to handle them only if asked to. Round trips made before
+ * the commit don't send them early. Changes not committed are dropped.
+ */
+class Transaction {
+    struct Change {
+        enum Kind { STATE, DESKTOP, GEOMETRY, PROPERTY } kind;
+        Window win;
+        Atom atom; // the state, or the property.
+        Atom second; // another state to change along with "atom", or None.
+        long value; // StateUpdateAction, or desktop.
+        Geometry geom;
+        Atom type; // the property's type, format and value.
+        int format;
+        std::vector<unsigned char> data;
+    };
+    const X11Env &x11;
+    std::vector<Change> changes;
+    Change &add(Change::Kind, Window);
+public:
+    Transaction(const X11Env &x11);
+    void state(Window, Atom, X11Env::StateUpdateAction, Atom second = None);
+    void desktop(Window, long desktop);
+    void geometry(Window, const Geometry &);
+    // Replace a property: "count" items of "format" bits, as XChangeProperty.
+    void property(Window, Atom property, Atom type, int format, const void *data, int count);
+    bool empty() const { return changes.empty(); }
+    void commit(bool wait = false); // wait: XSync, rather than XFlush.
+};